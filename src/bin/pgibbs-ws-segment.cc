@@ -0,0 +1,56 @@
+#include "pgibbs/config-ws-segment.h"
+#include "pgibbs/frozen-ws.h"
+#include "pgibbs/segmenter-ws.h"
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/time.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace pgibbs;
+
+int main(int argc, char** argv) {
+
+    // load the arguments
+    WSSegmentConfig conf;
+    vector<string> args = conf.loadConfig(argc,argv);
+    string method = conf.getString("method");
+    if(method != "viterbi" && method != "sample")
+        THROW_ERROR("Unknown segmentation method "<<method);
+    int threads = conf.getInt("threads");
+    if(threads <= 0)
+        threads = max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+    int batch = max(conf.getInt("batch"), 1);
+    int randSeed = conf.getInt("randseed");
+    srand(randSeed ? randSeed : time(NULL));
+
+    // map the model
+    WSFrozenModel model;
+    model.load(args[0]);
+    if(conf.getInt("verbose") > 0)
+        cerr << "Loaded "<<model.getWordCount()<<" words and "<<model.getNodeCount()<<" nodes from "<<args[0]<<endl;
+
+    // segment each input in order, keeping a few batches per thread in flight
+    ios_base::sync_with_stdio(false);
+    timeval tStart, tEnd;
+    gettimeofday(&tStart, NULL);
+    WSSegmentPool pool(model, method == "sample", threads, threads*4);
+    if(args.size() == 1)
+        pool.segment(cin, cout, batch);
+    for(int i = 1; i < (int)args.size(); i++) {
+        ifstream in(args[i].c_str());
+        if(!in)
+            THROW_ERROR("Could not open input file "<<args[i]);
+        pool.segment(in, cout, batch);
+    }
+    pool.finish(cout);
+    cout.flush();
+    gettimeofday(&tEnd, NULL);
+
+    double secs = (tEnd.tv_sec-tStart.tv_sec) + (tEnd.tv_usec-tStart.tv_usec)/1000000.0;
+    cerr << "Segmented "<<pool.getLineCount()<<" lines, "<<pool.getCharCount()<<" chars in "<<secs<<" s ("<<(secs > 0 ? pool.getCharCount()/secs : 0)<<" chars/s, threads="<<threads<<")"<<endl;
+
+}
@@ -21,12 +21,22 @@ int main(int argc, char** argv) {
 	conf.addConfigEntry("chars", "0", "");
     conf.setInt("chars",corp.getVocabSize());
 
+    // load the known boundaries
+    WSConstraints cons;
+    if(conf.getString("constraints").length())
+        cons.load(conf.getString("constraints"), corp, conf.getInt("maxlen"));
+
     // initialize the tags
     WSLabels labs;
-    labs.initRandom(corp,conf);
+    labs.initRandom(corp,conf,&cons);
 
     // create and train the model
     WSModel mod(conf);
+    mod.setConstraints(&cons);
     mod.train(corp,labs);
 
+    // save the model for segmenting new text
+    if(conf.getBool("freeze"))
+        mod.freeze(corp, args[1]+".frz");
+
 }
@@ -0,0 +1,42 @@
+#ifndef GNG_LOCK_STRIPES_H__
+#define GNG_LOCK_STRIPES_H__
+
+#include <pthread.h>
+
+namespace gng {
+
+// a fixed number of mutexes shared by many objects, where object i is
+//  covered by lock i % N. locking does nothing unless the stripes are
+//  active, and copies get fresh, inactive locks
+template < int N >
+class LockStripes {
+
+protected:
+    pthread_mutex_t locks_[N];
+    bool active_;
+
+    void init() {
+        for(int i = 0; i < N; i++)
+            pthread_mutex_init(&locks_[i], NULL);
+    }
+
+public:
+    LockStripes() : active_(false) { init(); }
+    LockStripes(const LockStripes &) : active_(false) { init(); }
+    ~LockStripes() {
+        for(int i = 0; i < N; i++)
+            pthread_mutex_destroy(&locks_[i]);
+    }
+    LockStripes & operator=(const LockStripes &) { return *this; }
+
+    void setActive(bool active) { active_ = active; }
+    bool isActive() const { return active_; }
+
+    void lock(int i) { if(active_) pthread_mutex_lock(&locks_[(unsigned)i % N]); }
+    void unlock(int i) { if(active_) pthread_mutex_unlock(&locks_[(unsigned)i % N]); }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef GNG_PERF_COUNTER_H__
+#define GNG_PERF_COUNTER_H__
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <cstring>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace gng {
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+// counts hardware cache misses in user space with perf_event_open, for the
+//  calling thread and any threads it starts while counting. if the counter
+//  can't be opened (no kernel support or no permission), isAvailable() is
+//  false and stop() returns -1
+class PerfCounter {
+
+protected:
+    int fd_;
+
+    // the file descriptor can't be shared
+    PerfCounter(const PerfCounter & pc);
+    PerfCounter & operator=(const PerfCounter & pc);
+
+public:
+    PerfCounter() : fd_(-1) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~PerfCounter() {
+        if(fd_ >= 0) close(fd_);
+    }
+
+    bool isAvailable() const { return fd_ >= 0; }
+
+    void start() {
+        if(fd_ < 0) return;
+        ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    // stop counting and return the count since start
+    long long stop() {
+        if(fd_ < 0) return -1;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        long long count;
+        if(read(fd_, &count, sizeof(count)) != sizeof(count))
+            return -1;
+        return count;
+    }
+
+};
+
+#else
+
+// without perf_event_open (non-Linux systems), nothing is ever counted
+class PerfCounter {
+
+public:
+    bool isAvailable() const { return false; }
+    void start() { }
+    long long stop() { return -1; }
+
+};
+
+#endif
+
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef GNG_PERFECT_HASH_H__
+#define GNG_PERFECT_HASH_H__
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+
+namespace gng {
+
+// a minimal perfect hash over a fixed set of distinct 64-bit keys, built by
+//  hash and displace. the keys are split into buckets, and the buckets are
+//  placed from the largest down, each trying displacements until all of its
+//  keys land on free slots. buckets of a single key take the next free slot
+//  directly, which is marked by the top bit of the displacement. lookups
+//  only need the array of displacements, so it can be read from a mapped
+//  file. a key that is not in the set still maps to some slot, so the
+//  caller must keep the key of each slot to check it
+class PerfectHash {
+
+public:
+
+    static const uint32_t DIRECT = 0x80000000u;
+    static const int MAX_TRIES = 1 << 20;
+
+    // the splitmix64 finalizer
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    // about four keys per bucket
+    static int getBucketCount(int keys) { return keys/4+1; }
+
+    static int getBucket(uint64_t h, int buckets) { return (int)((h >> 32) % buckets); }
+    static int getSlot(uint64_t h, uint32_t disp, int slots) {
+        return (int)(mix(h ^ (disp * 0x9e3779b97f4a7c15ULL)) % slots);
+    }
+
+    // find the only slot that key can be in, or -1 if there are no slots
+    static int find(uint64_t key, const uint32_t* disp, int buckets, int slots) {
+        if(slots == 0) return -1;
+        uint64_t h = mix(key);
+        uint32_t d = disp[getBucket(h, buckets)];
+        return (d & DIRECT) ? (int)(d & ~DIRECT) : getSlot(h, d, slots);
+    }
+
+    // build the displacements for keys, where slots[i] is the slot of keys[i]
+    static void build(const std::vector<uint64_t> & keys, std::vector<uint32_t> & disp, std::vector<int> & slots) {
+        int m = keys.size(), nb = getBucketCount(m);
+        std::vector<uint64_t> sorted(keys);
+        std::sort(sorted.begin(), sorted.end());
+        if(std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+            throw std::runtime_error("PerfectHash::build, keys are not distinct");
+        // put the keys in buckets, and order the buckets by size
+        std::vector< std::vector<int> > buckets(nb);
+        std::vector<uint64_t> hashes(m);
+        for(int i = 0; i < m; i++) {
+            hashes[i] = mix(keys[i]);
+            buckets[getBucket(hashes[i], nb)].push_back(i);
+        }
+        std::vector< std::pair<int,int> > order(nb);
+        for(int b = 0; b < nb; b++)
+            order[b] = std::pair<int,int>(-(int)buckets[b].size(), b);
+        std::sort(order.begin(), order.end());
+        // place each bucket
+        disp.assign(nb, 0);
+        slots.assign(m, -1);
+        std::vector<char> used(m, 0);
+        std::vector<int> mine;
+        int next = 0;
+        for(int o = 0; o < nb; o++) {
+            const std::vector<int> & bucket = buckets[order[o].second];
+            if(bucket.size() == 0) break;
+            if(bucket.size() == 1) {
+                while(used[next]) next++;
+                used[next] = 1;
+                slots[bucket[0]] = next;
+                disp[order[o].second] = DIRECT | next;
+                continue;
+            }
+            uint32_t d = 0;
+            for( ; ; d++) {
+                if(d == (uint32_t)MAX_TRIES)
+                    throw std::runtime_error("PerfectHash::build, could not place a bucket");
+                mine.clear();
+                int i = 0;
+                for( ; i < (int)bucket.size(); i++) {
+                    int s = getSlot(hashes[bucket[i]], d, m);
+                    if(used[s] || std::find(mine.begin(), mine.end(), s) != mine.end())
+                        break;
+                    mine.push_back(s);
+                }
+                if(i == (int)bucket.size())
+                    break;
+            }
+            for(int i = 0; i < (int)bucket.size(); i++) {
+                used[mine[i]] = 1;
+                slots[bucket[i]] = mine[i];
+            }
+            disp[order[o].second] = d;
+        }
+    }
+
+};
+
+}
+
+#endif
@@ -23,22 +23,51 @@ inline int discreteUniformSample(int size) {
     return rand() % size;
 }
 
+// the sampling functions below draw from rand() by default, or from a
+//  separate stream with rand_r if given a seed, so threads can sample
+//  without sharing (and serializing on) the global generator
+inline int randSample(unsigned * seed = 0) {
+    return seed ? rand_r(seed) : rand();
+}
+inline double uniformSample(unsigned * seed = 0) {
+    return (double)randSample(seed)/RAND_MAX;
+}
+
 // distribution sampling functions
-inline int bernoulliSample(double p) {
-    return (rand() < p*RAND_MAX?1:0);
+inline int bernoulliSample(double p, unsigned * seed = 0) {
+    return (randSample(seed) < p*RAND_MAX?1:0);
 }
-inline double exponSample(double l) {
-    return -1*log(1-(double)rand()/RAND_MAX)/l;
+inline double exponSample(double l, unsigned * seed = 0) {
+    return -1*log(1-uniformSample(seed))/l;
+}
+// the number of successes in n bernoulli trials, counting the geometric
+//  gaps between successes, so the cost is O(n*min(p,1-p)) not O(n)
+inline int binomialSample(int n, double p, unsigned * seed = 0) {
+    if(p > 0.5)
+        return n - binomialSample(n, 1-p, seed);
+    if(p <= 0)
+        return 0;
+    if(n < 16) {
+        int ret = 0;
+        for(int i = 0; i < n; i++)
+            ret += bernoulliSample(p, seed);
+        return ret;
+    }
+    double logq = log(1-p);
+    int ret = -1;
+    for(double pos = 0; pos <= n; ret++)
+        pos += floor(log((randSample(seed)+1.0)/(RAND_MAX+1.0))/logq) + 1;
+    return ret;
 }
-inline double gammaSample(double a, double scale) {
+inline double gammaSample(double a, double scale, unsigned * seed = 0) {
     double b, c, e, u, v, w, y, x, z;
     if(a > 1) { // Best's XG method
         b = a-1;
         c = 3*a-.75;
         bool accept = false;
         do {
-            u = (double)rand()/RAND_MAX;
-            v = (double)rand()/RAND_MAX;
+            u = uniformSample(seed);
+            v = uniformSample(seed);
             w = u*(1-u);
             y = sqrt(c/w)*(u-.5);
             x = b+y;
@@ -49,19 +78,19 @@ inline double gammaSample(double a, double scale) {
         } while (!accept);
     } else { // Johnk's method
         do {
-            u = (double)rand()/RAND_MAX;
-            v = (double)rand()/RAND_MAX;
+            u = uniformSample(seed);
+            v = uniformSample(seed);
             x = pow(u,1/a);
             y = pow(v,1/(1-a));
         } while (x+y > 1);
-        e = exponSample(1);
+        e = exponSample(1, seed);
         x = e*x/(x+y);
     }
     return x * scale;
 }
-inline double betaSample(double a, double b) {
-    double ga = gammaSample(a,1);
-    double gb = gammaSample(b,1);
+inline double betaSample(double a, double b, unsigned * seed = 0) {
+    double ga = gammaSample(a,1,seed);
+    double gb = gammaSample(b,1,seed);
     return ga/(ga+gb);
 }
 
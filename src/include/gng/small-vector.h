@@ -0,0 +1,129 @@
+#ifndef GNG_SMALL_VECTOR_H__
+#define GNG_SMALL_VECTOR_H__
+
+#include <algorithm>
+#include <cstring>
+
+namespace gng {
+
+// a vector that stores up to N elements inline and only allocates heap
+//  memory when it grows past that, for lists that are usually tiny.
+//  elements are moved with memcpy, so T must be a plain old data type
+template < class T, int N >
+class SmallVector {
+
+public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+    typedef T value_type;
+
+protected:
+    union Storage {
+        T inline_[N];
+        T* heap_;
+    };
+    Storage data_;
+    unsigned size_, capacity_;
+
+    bool isInline() const { return capacity_ == N; }
+
+    void reserveMore() {
+        unsigned newCap = capacity_*2;
+        T* newData = new T[newCap];
+        memcpy(newData, begin(), sizeof(T)*size_);
+        if(!isInline())
+            delete [] data_.heap_;
+        data_.heap_ = newData;
+        capacity_ = newCap;
+    }
+
+    // move back into inline storage. only done once the size has fallen to
+    //  half the inline capacity, so a vector hovering around N elements
+    //  does not allocate and free on every insert/erase
+    void shrinkInline() {
+        T* oldData = data_.heap_;
+        memcpy(data_.inline_, oldData, sizeof(T)*size_);
+        delete [] oldData;
+        capacity_ = N;
+    }
+
+public:
+    // the storage is zeroed so unused inline elements are never uninitialized
+    SmallVector() : data_(), size_(0), capacity_(N) { }
+    SmallVector(const SmallVector & vec) : data_(), size_(vec.size_), capacity_(vec.capacity_) {
+        if(isInline())
+            memcpy(data_.inline_, vec.data_.inline_, sizeof(T)*size_);
+        else {
+            data_.heap_ = new T[capacity_];
+            memcpy(data_.heap_, vec.data_.heap_, sizeof(T)*size_);
+        }
+    }
+    SmallVector(SmallVector && vec) : data_(), size_(0), capacity_(N) {
+        swap(vec);
+    }
+    ~SmallVector() {
+        if(!isInline())
+            delete [] data_.heap_;
+    }
+
+    SmallVector & operator=(const SmallVector & vec) {
+        SmallVector copy(vec);
+        swap(copy);
+        return *this;
+    }
+    SmallVector & operator=(SmallVector && vec) {
+        swap(vec);
+        return *this;
+    }
+
+    void swap(SmallVector & vec) {
+        std::swap(data_, vec.data_);
+        std::swap(size_, vec.size_);
+        std::swap(capacity_, vec.capacity_);
+    }
+
+    iterator begin() { return isInline() ? data_.inline_ : data_.heap_; }
+    iterator end() { return begin()+size_; }
+    const_iterator begin() const { return isInline() ? data_.inline_ : data_.heap_; }
+    const_iterator end() const { return begin()+size_; }
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+
+    T & operator[](int i) { return begin()[i]; }
+    const T & operator[](int i) const { return begin()[i]; }
+    T & back() { return begin()[size_-1]; }
+
+    void push_back(const T & val) {
+        if(size_ == capacity_) reserveMore();
+        begin()[size_++] = val;
+    }
+
+    iterator insert(iterator pos, const T & val) {
+        int idx = pos-begin();
+        if(size_ == capacity_) reserveMore();
+        T* data = begin();
+        memmove(data+idx+1, data+idx, sizeof(T)*(size_-idx));
+        data[idx] = val;
+        size_++;
+        return data+idx;
+    }
+
+    iterator erase(iterator pos) {
+        int idx = pos-begin();
+        T* data = begin();
+        memmove(data+idx, data+idx+1, sizeof(T)*(size_-idx-1));
+        size_--;
+        if(!isInline() && size_ <= (unsigned)N/2)
+            shrinkInline();
+        return begin()+idx;
+    }
+
+    // the number of bytes allocated outside of the object
+    size_t getHeapBytes() const { return isInline() ? 0 : capacity_*sizeof(T); }
+
+};
+
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef BOUNDS_WS_H__
+#define BOUNDS_WS_H__
+
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+namespace pgibbs {
+
+// the word boundaries of a sentence, with one bit per character that is set
+//  if a word ends after the character. the bits are packed into 64-bit
+//  words, so the set bits can be found and two segmentations compared a
+//  word at a time. bits past the end of the sentence are always zero
+class Bounds {
+
+protected:
+
+    vector<uint64_t> bits_;
+    int size_;
+
+public:
+
+    Bounds() : size_(0) { }
+    explicit Bounds(int size) : bits_((size+63)/64, 0), size_(size) { }
+
+    int size() const { return size_; }
+
+    bool operator[](int i) const { return (bits_[i>>6] >> (i&63)) & 1; }
+
+    void set(int i, bool val) {
+        if(val) bits_[i>>6] |= (uint64_t)1 << (i&63);
+        else    bits_[i>>6] &= ~((uint64_t)1 << (i&63));
+    }
+    void flip(int i) { bits_[i>>6] ^= (uint64_t)1 << (i&63); }
+
+    // clear the bits from beg to end
+    void clear(int beg, int end) {
+        for( ; beg < end && (beg&63); beg++) set(beg, 0);
+        for( ; beg+64 <= end; beg += 64) bits_[beg>>6] = 0;
+        for( ; beg < end; beg++) set(beg, 0);
+    }
+
+    // the first set bit at or after i, or size() if there is none
+    int next(int i) const {
+        if(i >= size_) return size_;
+        int w = i>>6;
+        uint64_t b = bits_[w] & (~(uint64_t)0 << (i&63));
+        while(b == 0) {
+            if(++w == (int)bits_.size()) return size_;
+            b = bits_[w];
+        }
+        return (w<<6) + __builtin_ctzll(b);
+    }
+
+    // the number of set bits before end
+    int count(int end) const {
+        int ret = 0, w = 0;
+        for( ; (w+1)<<6 <= end; w++) ret += __builtin_popcountll(bits_[w]);
+        if(end & 63) ret += __builtin_popcountll(bits_[w] & (((uint64_t)1 << (end&63))-1));
+        return ret;
+    }
+    int count() const { return count(size_); }
+
+    // the first and last bits that differ from bounds of the same size,
+    //  or -1 if they are the same
+    int firstDiff(const Bounds & b) const {
+        for(int w = 0; w < (int)bits_.size(); w++)
+            if(bits_[w] != b.bits_[w])
+                return (w<<6) + __builtin_ctzll(bits_[w] ^ b.bits_[w]);
+        return -1;
+    }
+    int lastDiff(const Bounds & b) const {
+        for(int w = bits_.size()-1; w >= 0; w--)
+            if(bits_[w] != b.bits_[w])
+                return (w<<6) + 63 - __builtin_clzll(bits_[w] ^ b.bits_[w]);
+        return -1;
+    }
+
+    bool operator==(const Bounds & b) const { return size_ == b.size_ && bits_ == b.bits_; }
+    bool operator!=(const Bounds & b) const { return !(*this == b); }
+
+};
+
+}
+
+#endif
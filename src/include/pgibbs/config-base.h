@@ -35,17 +35,23 @@ protected:
     string usage_;            // usage details
     vector<string> argOrder_;
 
+    bool sampler_;            // whether this is the configuration of a sampler
+
 public:
 
-    ConfigBase() : minArgs_(0), maxArgs_(255) { 
+    // programs that only use a trained model have no sampling options
+    ConfigBase(bool sampler = true) : minArgs_(0), maxArgs_(255), sampler_(sampler) { 
         addConfigEntry("verbose", "0", "The level of verbosity to use" );
+        if(!sampler)
+            return;
 		addConfigEntry("iters",   "10", "The number of iterations to perform");
 		addConfigEntry("threads", "1",  "The number of threads to use");
 		addConfigEntry("blocksize",  "1",  "The size of one block (for blocked sampling)");
 		addConfigEntry("shuffle",  "true",  "Whether to shuffle");
 		addConfigEntry("skipiters",  "0",  "The number of iters for which to skip the Metropolis-Hastings step");
 		addConfigEntry("printmod",  "false",  "Whether to print the model probabilities");
-		addConfigEntry("sampmeth", "sequence",  "Sampling method (sequence,parallel,block)");
+		addConfigEntry("sampmeth", "sequence",  "Sampling method (sequence,parallel,block,single,async,point). point is never parallel, and allows only -threads 1");
+		addConfigEntry("sentiters",  "0",  "For point sampling, the number of iterations between sentence-wise passes (0=never)");
 		addConfigEntry("randseed",  "0",  "The seed for the random number generator (0=time)");
         addConfigEntry("sampparam", "true", "Whether to sample the parameters" );
     }
@@ -63,16 +69,16 @@ public:
         exit(1);
     }
     
-    void printConf() const {
+    void printConf(ostream & out = cout) const {
         // print arguments
-        cout << "Main arguments:" << endl;
+        out << "Main arguments:" << endl;
         for(int i = 0; i < (int)mainArgs_.size(); i++)
-            cout << " "<<i<<": "<<mainArgs_[i]<<endl;
-        cout << "Optional arguments:"<<endl;
+            out << " "<<i<<": "<<mainArgs_[i]<<endl;
+        out << "Optional arguments:"<<endl;
         for(vector<string>::const_iterator it = argOrder_.begin(); it != argOrder_.end(); it++) {
             ConfigMap::const_iterator oit = optArgs_.find(*it);
             if(oit->second.second.length() != 0)
-                cout << " -"<<oit->first<<" \t"<<oit->second.first<<endl;
+                out << " -"<<oit->first<<" \t"<<oit->second.first<<endl;
         }
     }
 
@@ -97,6 +103,12 @@ public:
             DIE_HELP("Wrong number of arguments");
         }
 
+        // other programs write their results to stdout
+        if(!sampler_) {
+            printConf(cerr);
+            return mainArgs_;
+        }
+
         // method specific settings
         string sampMeth = getString("sampmeth");
         if(sampMeth == "sequence") {
@@ -111,6 +123,14 @@ public:
             // nothing to check for now
         } else if(sampMeth == "single") {
             // nothing to check for now
+        } else if(sampMeth == "async") {
+            if(getInt("blocksize") > 1)
+                THROW_ERROR("Blocksize > 1 ("<<getInt("blocksize")<<") for async sampling");
+        } else if(sampMeth == "point") {
+            if(getInt("blocksize") > 1)
+                THROW_ERROR("Blocksize > 1 ("<<getInt("blocksize")<<") for point sampling");
+            if(getInt("threads") > 1)
+                THROW_ERROR("Threads > 1 ("<<getInt("threads")<<") for point sampling");
         } else {
             THROW_ERROR("Unknown sampling method "<<sampMeth);
         }
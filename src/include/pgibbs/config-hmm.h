@@ -32,6 +32,7 @@ public:
 		addConfigEntry("ediscb", "1.0", "The beta for the discount of the emission distribution (PY only).");
 
         addConfigEntry("base", "uniform", "The distribution for the base measure (uniform/unigram).");
+        addConfigEntry("refresh", "100", "The number of sentences between refreshes of the shared transition probabilities (async only).");
 		
 	}
 		
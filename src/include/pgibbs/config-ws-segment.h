@@ -0,0 +1,29 @@
+#ifndef CONFIG_WS_SEGMENT_H__
+#define CONFIG_WS_SEGMENT_H__
+
+#include "pgibbs/config-base.h"
+
+namespace pgibbs {
+
+class WSSegmentConfig : public ConfigBase {
+
+public:
+
+	WSSegmentConfig() : ConfigBase(false) {
+        minArgs_ = 1;
+        maxArgs_ = 255;
+
+        setUsage("~~~ pgibbs-ws-segment ~~~\n  by Graham Neubig\n\nSegments text with a model frozen by pgibbs-ws -freeze.\n\nUsage: pgibbs-ws-segment MODEL_FILE [INPUT_FILE...]\n  (reads standard input if no input file is given)\n");
+
+        addConfigEntry("method", "viterbi", "The segmentation method (viterbi=best path, sample=sample a path)");
+        addConfigEntry("threads", "0", "The number of threads to use (0=one per core)");
+        addConfigEntry("batch", "256", "The number of lines given to a thread at once");
+        addConfigEntry("randseed", "0", "The seed for the random number generator (0=time)");
+
+	}
+
+};
+
+}
+
+#endif
@@ -18,6 +18,12 @@ public:
         addConfigEntry("n", "2", "The n-gram size of the language model.");
         addConfigEntry("maxlen", "8", "The maximum length of a string.");
         addConfigEntry("avglen", "2.0", "The average length of a string.");
+        addConfigEntry("compact", "true", "Whether to renumber and compact the LM nodes between iterations.");
+        addConfigEntry("constraints", "", "A file of known boundaries, with one line per sentence and a flag after each character (1=boundary, 0=no boundary, -=unknown).");
+        addConfigEntry("chunk", "0", "The spacing of the overlapping windows that longer sentences are sampled in (0=sample whole sentences).");
+        addConfigEntry("slice", "0.0", "The exponent of the slice variables used to prune the lattice, from 0 (no pruning) to 1 (most pruning).");
+        addConfigEntry("candmem", "256", "The memory in MB used to cache candidate word IDs for sentences.");
+        addConfigEntry("freeze", "false", "Whether to write a read-only model to OUTPUT_PREFIX.frz after training.");
 		addConfigEntry("samphyp", "false", "Whether to sample the hyperparameters.");
 		addConfigEntry("usepy",   "false", "Whether to use a PY distribution (otherwise Dirichlet)");
 		
@@ -0,0 +1,88 @@
+#ifndef CONSTRAINTS_WS_H__
+#define CONSTRAINTS_WS_H__
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+
+#include "pgibbs/definitions.h"
+#include "pgibbs/corpus-word.h"
+
+using namespace std;
+
+namespace pgibbs {
+
+// known boundaries of the sentences, for example at punctuation or script
+//  changes. they are read from a file with one line per sentence and one
+//  flag per character, separated by spaces like the characters themselves:
+//  "1" if there must be a boundary after the character, "0" if there must
+//  not be one, and "-" if it is unknown. empty lines have no constraints
+class WSConstraints {
+
+public:
+
+    enum Flag { FREE = 0, SPLIT = 1, JOIN = 2 };
+
+protected:
+
+    vector< vector<char> > flags_;
+
+public:
+
+    WSConstraints() { }
+
+    // load the flags, checking that they fit the corpus, and that no run of
+    //  joined characters is longer than maxLen
+    void load(istream & in, const CorpusBase<WordSent> & corp, int maxLen) {
+        string line, str;
+        flags_.clear();
+        while(getline(in,line)) {
+            int sid = flags_.size();
+            if(sid >= (int)corp.size())
+                THROW_ERROR("More constraint lines than sentences ("<<corp.size()<<")");
+            flags_.push_back(vector<char>());
+            vector<char> & flags = flags_.back();
+            istringstream iss(line);
+            while(iss >> str) {
+                if(str == "1") flags.push_back(SPLIT);
+                else if(str == "0") flags.push_back(JOIN);
+                else if(str == "-") flags.push_back(FREE);
+                else THROW_ERROR("Bad constraint '"<<str<<"' for sentence "<<sid);
+            }
+            if(flags.size() == 0)
+                continue;
+            int len = corp[sid].length();
+            if((int)flags.size() != len)
+                THROW_ERROR("Sentence "<<sid<<" has "<<len<<" characters but "<<flags.size()<<" constraints");
+            if(flags[len-1] == JOIN)
+                THROW_ERROR("The end of sentence "<<sid<<" must be a boundary");
+            for(int i = 0, last = -1; i < len; i++) {
+                if(flags[i] == JOIN) continue;
+                if(i-last > maxLen)
+                    THROW_ERROR("Sentence "<<sid<<" forces a word of length "<<i-last<<" at "<<last+1<<", longer than "<<maxLen);
+                last = i;
+            }
+        }
+    }
+
+    void load(const string & fileName, const CorpusBase<WordSent> & corp, int maxLen) {
+        ifstream in(fileName.c_str());
+        if(!in)
+            THROW_ERROR("could not find constraint file " << fileName);
+        load(in,corp,maxLen);
+    }
+
+    // the flags of a sentence, or 0 if it has no constraints
+    const char* getFlags(int sid) const {
+        return (sid < (int)flags_.size() && flags_[sid].size() ? &flags_[sid][0] : 0);
+    }
+
+    int size() const { return flags_.size(); }
+
+};
+
+}
+
+#endif
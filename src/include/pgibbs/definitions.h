@@ -7,6 +7,8 @@
 #include <algorithm>
 #include <cmath>
 
+#include "gng/samp-gen.h"
+
 // define this to perform extra debugging checks
 // #define DEBUG_ON
 
@@ -45,17 +47,17 @@ inline void normalizeLogProbs(std::vector<double> & vec, double anneal = 1) {
     normalizeLogProbs(&vec[0],vec.size(),anneal);
 }
 
-// sample a single probability
-inline int sampleProbs(double* vec, int size) {
-    double left = (double)rand()/RAND_MAX;
+// sample a single probability, using rand_r if seed is given
+inline int sampleProbs(double* vec, int size, unsigned * seed = 0) {
+    double left = uniformSample(seed);
     int ret = 0;
     while(ret+1 < size && (left -= vec[ret]) > 0)
         ret++;
     return ret;
 }
 
-inline int sampleProbs(std::vector<double> vec) {
-    return sampleProbs(&vec[0],vec.size());
+inline int sampleProbs(std::vector<double> vec, unsigned * seed = 0) {
+    return sampleProbs(&vec[0],vec.size(),seed);
 }
 
 // sample a single set of log probabilities
@@ -2,55 +2,212 @@
 #define PYDIST_H__
 
 #include "gng/samp-gen.h"
+#include "gng/small-vector.h"
 #include "pgibbs/definitions.h"
 #include <vector>
 #include <stdexcept>
 #include <cmath>
 #include <iostream>
+#include <pthread.h>
 
 namespace pgibbs {
 
-class PyTableSet : public std::vector< int > {
+// the number of tables inline in a table set before spilling to the heap
+#define PY_INLINE_TABLES 2
+
+// the seating arrangement for a single ID, stored as a list of table sizes.
+//  most IDs only have one or two tables, so these are kept inline
+class PyTableSet : public gng::SmallVector< int, PY_INLINE_TABLES > {
+
+public:
+    int total;
+    PyTableSet() : gng::SmallVector< int, PY_INLINE_TABLES >(), total(0) { }
+
+    void swap(PyTableSet & set) {
+        gng::SmallVector< int, PY_INLINE_TABLES >::swap(set);
+        std::swap(total, set.total);
+    }
+
+    // seat a customer at an existing table, return the table's old size.
+    //  the random choices use rand(), or rand_r if seed is given
+    int addExisting(double disc, unsigned * seed = 0) {
+        int mySize = size();
+        iterator it = begin();
+        if(mySize > 1) {
+            double left = randSample(seed)*(total-mySize*disc)/RAND_MAX;
+            while((left -= (*it)-disc) > 0) {
+                if(it + 1 == end()) break;
+                it++;
+            }
+        }
+        total++;
+        return (*it)++;
+    }
+
+    void addNew() {
+        push_back(1);
+        total++;
+    }
+
+    // remove a random customer, return the old size of its table
+    int remove(unsigned * seed = 0) {
+        int mySize = size();
+        iterator it = begin();
+        if(mySize > 1) {
+            int left = randSample(seed) % total;
+            while((left -= (*it)) >= 0)
+                it++;
+        }
+        total--;
+        int ret = (*it)--;
+        if((*it) == 0)
+            erase(it);
+        return ret;
+    }
+
+};
+
+// the seating arrangement for a single ID, stored as a histogram of
+//  table sizes. this is equivalent to PyTableSet under exchangeability,
+//  but seating costs O(distinct table sizes) instead of O(tables)
+struct PyTableCount {
+    int size, count;
+};
+
+class PyHistTableSet {
+
+protected:
+    // the number of tables of each size, sorted by size. a single size is
+    //  kept inline, which covers every ID that has only one table
+    typedef gng::SmallVector< PyTableCount, 1 > Hist;
+    Hist hist_;
+    int tables_;
+
+    // move one table in entry i to the size newSize, which neighbors it
+    void moveTable(int i, int newSize) {
+        int j = (newSize > hist_[i].size ? i+1 : i-1);
+        if(newSize == 0) {
+            tables_--;
+        } else if(j >= 0 && j < (int)hist_.size() && hist_[j].size == newSize) {
+            hist_[j].count++;
+        } else {
+            j = (newSize > hist_[i].size ? i+1 : i);
+            PyTableCount newCount = { newSize, 1 };
+            hist_.insert(hist_.begin()+j, newCount);
+            if(j == i) i++;
+        }
+        if(--hist_[i].count == 0)
+            hist_.erase(hist_.begin()+i);
+    }
 
 public:
     int total;
-    PyTableSet() : std::vector< int >(), total(0) { }
+    PyHistTableSet() : hist_(), tables_(0), total(0) { }
+
+    // the number of tables
+    int size() const { return tables_; }
+
+    void swap(PyHistTableSet & set) {
+        hist_.swap(set.hist_);
+        std::swap(tables_, set.tables_);
+        std::swap(total, set.total);
+    }
+
+    int addExisting(double disc, unsigned * seed = 0) {
+        int i = 0, last = hist_.size()-1;
+        if(tables_ > 1) {
+            double left = randSample(seed)*(total-tables_*disc)/RAND_MAX;
+            while(i < last && (left -= hist_[i].count*(hist_[i].size-disc)) > 0)
+                i++;
+        }
+        int ret = hist_[i].size;
+        moveTable(i, ret+1);
+        total++;
+        return ret;
+    }
+
+    void addNew() {
+        if(hist_.size() && hist_[0].size == 1) {
+            hist_[0].count++;
+        } else {
+            PyTableCount newCount = { 1, 1 };
+            hist_.insert(hist_.begin(), newCount);
+        }
+        tables_++;
+        total++;
+    }
+
+    int remove(unsigned * seed = 0) {
+        int i = 0;
+        if(tables_ > 1) {
+            int left = randSample(seed) % total;
+            while((left -= hist_[i].count*hist_[i].size) >= 0)
+                i++;
+        }
+        int ret = hist_[i].size;
+        moveTable(i, ret-1);
+        total--;
+        return ret;
+    }
+
+    size_t getHeapBytes() const { return hist_.getHeapBytes(); }
 
 };
 
+template < class TableSet = PyTableSet >
 class PyDenseIndex {
 protected:
-    std::vector< PyTableSet > idx_;
+    std::vector< TableSet > idx_;
 public:
-    typedef std::vector< PyTableSet >::iterator iterator;
+    typedef typename std::vector< TableSet >::iterator iterator;
     iterator begin() { return idx_.begin(); }
     iterator end() { return idx_.end(); }
-    PyTableSet & iterTableSet(iterator it) { return *it; }
+    TableSet & iterTableSet(iterator it) { return *it; }
     
-    const PyTableSet * getTableSet(int id) const { 
+    const TableSet * getTableSet(int id) const { 
         return (int)idx_.size() > id ? &(idx_[id]) : 0; 
     }
     int getTotal(int id) const {
         return (int)idx_.size() > id ? (idx_[id]).total : 0; 
     }
-    PyTableSet & addTableSet(int id) {
+    TableSet & addTableSet(int id) {
         if((int)idx_.size() <= id) idx_.resize(id+1);
         return idx_[id];
     }
     void removeTableSet(int id) { } // do not remove, we're dense, remember?
+
+    // add the IDs with customers to ids
+    void getIds(std::vector<int> & ids) const {
+        for(int i = 0; i < (int)idx_.size(); i++)
+            if(idx_[i].total) ids.push_back(i);
+    }
+
+    int getEntryCount() const {
+        int ret = 0;
+        for(int i = 0; i < (int)idx_.size(); i++)
+            if(idx_[i].total) ret++;
+        return ret;
+    }
+    size_t getMemoryUsage() const {
+        size_t ret = idx_.capacity()*sizeof(TableSet);
+        for(int i = 0; i < (int)idx_.size(); i++)
+            ret += idx_[i].getHeapBytes();
+        return ret;
+    }
 };
 
+template < class TableSet = PyTableSet >
 class PySparseIndex {
 protected:
-    std::unordered_map< int, PyTableSet > idx_;
+    std::unordered_map< int, TableSet > idx_;
 public:
-    typedef std::unordered_map< int, PyTableSet >::const_iterator const_iterator;
-    typedef std::unordered_map< int, PyTableSet >::iterator iterator;
+    typedef typename std::unordered_map< int, TableSet >::const_iterator const_iterator;
+    typedef typename std::unordered_map< int, TableSet >::iterator iterator;
     iterator begin() { return idx_.begin(); }
     iterator end() { return idx_.end(); }
-    PyTableSet & iterTableSet(iterator it) { return it->second; }
+    TableSet & iterTableSet(iterator it) { return it->second; }
 
-    const PyTableSet * getTableSet(int id) const {
+    const TableSet * getTableSet(int id) const {
         const_iterator it = idx_.find(id);
         return it == idx_.end() ? 0 : & it->second;
     }
@@ -58,50 +215,313 @@ public:
         const_iterator it = idx_.find(id);
         return it == idx_.end() ? 0 : it->second.total;
     }
-    PyTableSet & addTableSet(int id) {
+    TableSet & addTableSet(int id) {
         iterator it = idx_.find(id);
         if(it == idx_.end()) 
-            it = idx_.insert( std::pair< int, PyTableSet >(id,PyTableSet()) ).first;
+            it = idx_.insert( std::pair< int, TableSet >(id,TableSet()) ).first;
         return it->second;
     }
     void removeTableSet(int id) {
         idx_.erase(id);
     }
+
+    void getIds(std::vector<int> & ids) const {
+        for(const_iterator it = idx_.begin(); it != idx_.end(); it++)
+            if(it->second.total) ids.push_back(it->first);
+    }
+
+    int getEntryCount() const { return idx_.size(); }
+    // approximate, counting one pointer per bucket and per node
+    size_t getMemoryUsage() const {
+        size_t ret = idx_.bucket_count()*sizeof(void*) +
+            idx_.size()*(sizeof(typename std::unordered_map< int, TableSet >::value_type)+sizeof(void*));
+        for(const_iterator it = idx_.begin(); it != idx_.end(); it++)
+            ret += it->second.getHeapBytes();
+        return ret;
+    }
+};
+
+// an index that starts as an open-addressing hash (linear probing) and is
+//  promoted to a dense array once the IDs it holds are packed tightly enough
+template < class TableSet = PyTableSet >
+class PyAdaptiveIndex {
+protected:
+    // table sets, by ID when dense or by hash slot when sparse
+    std::vector< TableSet > vals_;
+    // the ID held in each hash slot (-1 if empty), unused when dense
+    std::vector< int > keys_;
+    int size_, maxId_, shift_;
+    bool dense_;
+
+    // promote when more than 1/DENSE_RATIO of the IDs up to the max are used
+    static const int DENSE_RATIO = 3;
+    static const int INIT_BITS = 1;
+
+    int home(int id) const {
+        return (int)(((unsigned)id * 2654435761u) >> shift_);
+    }
+    // find the slot of an ID, or the empty slot where it should go
+    int findSlot(int id) const {
+        const int mask = keys_.size()-1;
+        int i = home(id);
+        while(keys_[i] != id && keys_[i] != -1)
+            i = (i+1) & mask;
+        return i;
+    }
+    void rehash(int bits) {
+        std::vector< TableSet > oldVals(1 << bits);
+        std::vector< int > oldKeys(1 << bits, -1);
+        oldVals.swap(vals_); oldKeys.swap(keys_);
+        shift_ = 32 - bits;
+        for(int i = 0; i < (int)oldKeys.size(); i++) {
+            if(oldKeys[i] == -1) continue;
+            int j = findSlot(oldKeys[i]);
+            keys_[j] = oldKeys[i];
+            vals_[j].swap(oldVals[i]);
+        }
+    }
+    void promote() {
+        std::vector< TableSet > oldVals(maxId_+1);
+        oldVals.swap(vals_);
+        for(int i = 0; i < (int)keys_.size(); i++)
+            if(keys_[i] != -1)
+                vals_[keys_[i]].swap(oldVals[i]);
+        std::vector< int >().swap(keys_);
+        dense_ = true;
+    }
+    // go back to hashing when a new ID would make the dense array too sparse
+    void demote() {
+        int bits = INIT_BITS;
+        while((size_+1)*4 > (1 << bits)*3) bits++;
+        std::vector< TableSet > oldVals(1 << bits);
+        oldVals.swap(vals_);
+        keys_ = std::vector< int >(1 << bits, -1);
+        shift_ = 32 - bits;
+        dense_ = false;
+        for(int i = 0; i < (int)oldVals.size(); i++) {
+            if(oldVals[i].total == 0) continue;
+            maxId_ = std::max(maxId_, i);
+            int j = findSlot(i);
+            keys_[j] = i;
+            vals_[j].swap(oldVals[i]);
+        }
+    }
+
+public:
+    typedef typename std::vector< TableSet >::iterator iterator;
+
+    // an empty index is an empty dense array, so nothing is allocated
+    //  until the first ID is added
+    PyAdaptiveIndex() : size_(0), maxId_(-1), shift_(32-INIT_BITS), dense_(true) { }
+
+    // iteration may visit empty table sets, as with the dense index
+    iterator begin() { return vals_.begin(); }
+    iterator end() { return vals_.end(); }
+    TableSet & iterTableSet(iterator it) { return *it; }
+
+    const TableSet * getTableSet(int id) const {
+        if(id < 0) return 0;
+        if(dense_)
+            return (int)vals_.size() > id ? &(vals_[id]) : 0;
+        int i = findSlot(id);
+        return keys_[i] == id ? &(vals_[i]) : 0;
+    }
+    int getTotal(int id) const {
+        const TableSet * set = getTableSet(id);
+        return set ? set->total : 0;
+    }
+    TableSet & addTableSet(int id) {
+        if(dense_) {
+            if(id < (int)vals_.size()) {
+                if(vals_[id].total == 0) size_++;
+                return vals_[id];
+            }
+            if((size_+1)*DENSE_RATIO > id+1) {
+                vals_.resize(id+1);
+                size_++;
+                return vals_[id];
+            }
+            demote();
+        }
+        int i = findSlot(id);
+        if(keys_[i] == id)
+            return vals_[i];
+        maxId_ = std::max(maxId_, id);
+        if((size_+1)*DENSE_RATIO > maxId_+1) {
+            promote();
+            size_++;
+            return vals_[id];
+        }
+        if((size_+1)*4 > (int)keys_.size()*3) {
+            rehash(33 - shift_);
+            i = findSlot(id);
+        }
+        keys_[i] = id;
+        size_++;
+        return vals_[i];
+    }
+    void removeTableSet(int id) {
+        if(dense_) {
+            if(id < (int)vals_.size() && vals_[id].total == 0) size_--;
+            return;
+        }
+        int i = findSlot(id);
+        if(keys_[i] != id) return;
+        // remove with backward shifting so no tombstones are needed
+        const int mask = keys_.size()-1;
+        keys_[i] = -1; TableSet().swap(vals_[i]);
+        size_--;
+        for(int j = (i+1) & mask; keys_[j] != -1; j = (j+1) & mask) {
+            int k = home(keys_[j]);
+            if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            keys_[i] = keys_[j]; keys_[j] = -1;
+            vals_[i].swap(vals_[j]);
+            i = j;
+        }
+    }
+
+    void getIds(std::vector<int> & ids) const {
+        for(int i = 0; i < (int)vals_.size(); i++)
+            if(vals_[i].total) ids.push_back(dense_ ? i : keys_[i]);
+    }
+
+    bool isDense() const { return dense_; }
+
+    int getEntryCount() const { return size_; }
+    size_t getMemoryUsage() const {
+        size_t ret = vals_.capacity()*sizeof(TableSet) + keys_.capacity()*sizeof(int);
+        for(int i = 0; i < (int)vals_.size(); i++)
+            ret += vals_[i].getHeapBytes();
+        return ret;
+    }
+};
+
+// draws the auxiliary variables used to sample PY hyperparameters for a
+//  share of the (count, multiplicity) buckets, with its own random stream
+class PyAuxJob {
+
+public:
+    pthread_t thread_;
+    unsigned seed_;
+    // the stream to draw from, &seed_ or the caller's own stream (0 for rand())
+    unsigned * stream_;
+    double stren_, disc_;
+
+    // input buckets of (count, number of nodes or tables with that count)
+    std::vector< std::pair<int,int> > nodeTables_, nodeCusts_, tableCusts_;
+
+    // output additions to the prior parameters
+    double sa_, sb_, da_, db_;
+
+    PyAuxJob() : seed_(0), stream_(0), stren_(0), disc_(0), sa_(0), sb_(0), da_(0), db_(0) { }
+
+    void run() {
+        // the m repeated bernoulli draws for each j are one binomial draw
+        for(int i = 0; i < (int)nodeTables_.size(); i++) {
+            int t = nodeTables_[i].first, m = nodeTables_[i].second;
+            for(int j = 1; j < t; j++) {
+                int y = binomialSample(m, stren_/(stren_+disc_*j), stream_);
+                sa_ += y;
+                da_ += m-y;
+            }
+        }
+        // -log of a Beta(a,c-1) draw is a sum of exponentials with rates a,
+        //  a+1, ..., a+c-2, so the sum over m draws is c-1 gamma draws with
+        //  shape m. use this when it is cheaper than m beta draws
+        for(int i = 0; i < (int)nodeCusts_.size(); i++) {
+            int c = nodeCusts_[i].first, m = nodeCusts_[i].second;
+            if(c-1 < 2*m) {
+                for(int k = 0; k < c-1; k++)
+                    sb_ += (m == 1 ? exponSample(stren_+1+k,stream_) : gammaSample(m,1/(stren_+1+k),stream_));
+            } else {
+                for(int k = 0; k < m; k++)
+                    sb_ -= log(betaSample(stren_+1,c-1,stream_));
+            }
+        }
+        for(int i = 0; i < (int)tableCusts_.size(); i++) {
+            int c = tableCusts_[i].first, m = tableCusts_[i].second;
+            for(int j = 1; j < c; j++)
+                db_ += m-binomialSample(m, (j-1)/(j-disc_), stream_);
+        }
+    }
+
 };
 
-template < class Index >
+inline void* runPyAuxJob(void* ptr) {
+    ((PyAuxJob*)ptr)->run();
+    return NULL;
+}
+
+// a Pitman-Yor distribution, where Index decides how the seating arrangement
+//  of each ID is looked up, and TableSet how it is stored
+template < template < class > class Index, class TableSet = PyTableSet >
 class PyDist {
 
 private:
 
-    typedef PyTableSet::iterator PyTableSetIter;
-    typedef PyTableSet::const_iterator PyTableSetCIter;
-
     int customers_, tables_;
-    Index counts_;
+    Index< TableSet > counts_;
     // double spAlpha_, spBeta_, dpAlpha_, dpBeta_;
 
+    // the number of tables of each size from 2 up, kept up to date so
+    //  sampling hyperparameters does not need to visit every table. only
+    //  sizes with tables are kept, sorted by size, so the memory is
+    //  O(distinct table sizes) and not O(largest table)
+    typedef gng::SmallVector< PyTableCount, 2 > SizeCounts;
+    SizeCounts sizeCounts_;
+
     double stren_, disc_;
     bool tableAdded_, tableRemoved_;
 
+    // the fallback mass and inverse denominator, which are updated whenever
+    //  the counts or parameters change so getProb needs no division
+    double fallback_, invDenom_;
+
+    void updateCache() {
+        invDenom_ = 1/(customers_+stren_);
+        fallback_ = (stren_+tables_*disc_)*invDenom_;
+    }
+
+    static bool smallerTable(const PyTableCount & count, int size) { return count.size < size; }
+
+    void changeTableSize(int oldSize, int newSize) {
+        if(oldSize > 1) {
+            typename SizeCounts::iterator it = std::lower_bound(sizeCounts_.begin(), sizeCounts_.end(), oldSize, smallerTable);
+            if(--it->count == 0)
+                sizeCounts_.erase(it);
+        }
+        if(newSize > 1) {
+            typename SizeCounts::iterator it = std::lower_bound(sizeCounts_.begin(), sizeCounts_.end(), newSize, smallerTable);
+            if(it != sizeCounts_.end() && it->size == newSize) {
+                it->count++;
+            } else {
+                PyTableCount newCount = { newSize, 1 };
+                sizeCounts_.insert(it, newCount);
+            }
+        }
+    }
+
 public:
 
     PyDist(double stren, double disc) : customers_(0), tables_(0), counts_(), 
-        stren_(stren), disc_(disc) { }
+        stren_(stren), disc_(disc), tableAdded_(false), tableRemoved_(false) { updateCache(); }
+
+    // the probability of id without the fallback to the base
+    double getCountProb(int id) const {
+        const TableSet * tab = counts_.getTableSet(id);
+        return tab ? (tab->total-disc_*tab->size())*invDenom_ : 0;
+    }
 
     double getProb(int id, double base) const {
-        const PyTableSet * tab = counts_.getTableSet(id);
-        double myCount = tab ? tab->total-disc_*tab->size() : 0;
-        // if(debug)
-        //     cerr << " getProb("<<id<<","<<base<<"): ( "<<myCount<<"+"<<base<<"*("<<stren_<<"+"<<tables_<<"*"<<disc_<<") )/("<<customers_<<"+"<<stren_<<")";
-        return ( myCount+base*(stren_+tables_*disc_) )/(customers_+stren_);
+        return getCountProb(id)+base*fallback_;
     }
     int getTotal(int id) const {
         return counts_.getTotal(id);
     }
 
     double getFallbackProb() const {
-        return (stren_+tables_*disc_)/(customers_+stren_);
+        return fallback_;
     }
 
     std::vector<double> getAllProbs(const std::vector<double> & bases) const {
@@ -122,48 +542,41 @@ public:
         return ret;
     }
 
-    void addExisting(int id) {
-        PyTableSet & set = counts_.addTableSet(id);
+    void addExisting(int id, unsigned * seed = 0) {
+        TableSet & set = counts_.addTableSet(id);
 #ifdef DEBUG_ON
         if(set.total == 0)
             throw std::runtime_error("PyDist::addExisting with no tables");
 #endif
-        int mySize = set.size();
-        PyTableSetIter it = set.begin();
-        if(mySize > 1) {
-            double left = rand()*(set.total-mySize*disc_)/RAND_MAX;
-            while((left -= (*it)-disc_) > 0) {
-                if(it + 1 == set.end()) break;
-                it++;
-            }
-        }
-        (*it)++;
-        set.total++;
+        int oldSize = set.addExisting(disc_, seed);
+        changeTableSize(oldSize, oldSize+1);
         customers_++;
         tableAdded_ = false;
+        updateCache();
     }
 
     void addNew(int id) {
-        PyTableSet & set = counts_.addTableSet(id);
-        set.push_back(1);
-        set.total++;
+        TableSet & set = counts_.addTableSet(id);
+        set.addNew();
         tables_++;
         customers_++;
         tableAdded_ = true;
+        updateCache();
     }
 
-    // add one and return the probability
-    double add(int id, double base) {
+    // add one and return the probability. seating draws from rand(), or
+    //  from rand_r if seed is given
+    double add(int id, double base, unsigned * seed = 0) {
         double genProb = getProb(id,0), baseProb = base*getFallbackProb(), totProb = genProb+baseProb;
-        tableAdded_ = !bernoulliSample(genProb/totProb);
+        tableAdded_ = !bernoulliSample(genProb/totProb, seed);
         if(tableAdded_)
             addNew(id);
         else
-            addExisting(id);
+            addExisting(id, seed);
         return totProb;
     }
      
-    double remove(int id, double base) {
+    double remove(int id, double base, unsigned * seed = 0) {
 #ifdef DEBUG_ON
         if(id < 0)
             THROW_ERROR("Illegal value " << id << " in PyDist::remove");
@@ -171,27 +584,19 @@ public:
             THROW_ERROR("Overflow in PyDist::remove for " << id); 
 #endif
         tableRemoved_ = false;
-        PyTableSet & set = counts_.addTableSet(id);
+        TableSet & set = counts_.addTableSet(id);
 #ifdef DEBUG_ON
         if(set.total == 0)
             THROW_ERROR("Overflow in PyDist::remove for " << id); 
 #endif
-        int mySize = set.size();
-        PyTableSetIter it = set.begin();
-        
-        if(mySize > 1) {
-            int left = rand() % set.total;
-            while((left -= (*it)) >= 0)
-                it++;
-        }
-        (*it)--;
-        set.total--;
         customers_--;
-        if((*it) == 0) {
+        int oldSize = set.remove(seed);
+        changeTableSize(oldSize, oldSize-1);
+        if(oldSize == 1) {
             tableRemoved_ = true;
             tables_--;
-            set.erase(it);
         }
+        updateCache();
         if(set.total == 0)
             counts_.removeTableSet(id);
         return getProb(id,base);
@@ -214,21 +619,18 @@ protected:
             addCount(nodeTableCounts,tables_);
             addCount(nodeCustCounts,customers_);
         }
-        for(typename Index::iterator it = counts_.begin(); it != counts_.end(); it++) {
-            const PyTableSet & tabs = counts_.iterTableSet(it);
-            const int tabsize = tabs.size();
-            for(int i = 0; i < tabsize; i++)
-                if(tabs[i] > 1)
-                    addCount(tableCustCounts,tabs[i]);
-        }
+        for(int i = 0; i < (int)sizeCounts_.size(); i++)
+            tableCustCounts[sizeCounts_[i].size] += sizeCounts_[i].count;
     }
 
 public:
 
 
     // sample parameters for several distributions with tied parameters
-    //  use da, db, sa, sb as prior probabilities
-    static std::pair<double,double> sampleParameters(std::vector<PyDist*> & dists, double sa, double sb, double da, double db) { 
+    //  use da, db, sa, sb as prior probabilities. the auxiliary variables
+    //  for different count buckets are drawn in parallel over "threads"
+    //  threads, and if seed is given it is used instead of rand()
+    static std::pair<double,double> sampleParameters(std::vector<PyDist*> & dists, double sa, double sb, double da, double db, int threads = 1, unsigned * seed = 0) { 
         // gather the counts
         CountMap nodeTableCounts, nodeCustCounts, tableCustCounts;
         int totalCustCount = 0, totalTableCount = 0;
@@ -240,26 +642,40 @@ public:
 #endif
             dists[i]->gatherCounts(nodeCustCounts,nodeTableCounts,tableCustCounts,totalCustCount,totalTableCount);
         }
-        // calculate and add the auxiliary variables
-        int yui = 0;
-        for(CountMap::const_iterator it = nodeTableCounts.begin(); it != nodeTableCounts.end(); it++) {
-            for(int j = 1; j < it->first; j++) {
-                for(int k = 0; k < it->second; k++) {
-                    yui = bernoulliSample(stren/(stren+disc*j));
-                    da += (1-yui);
-                    sa += yui;
-                }
+        // divide the count buckets evenly between jobs
+        std::vector<PyAuxJob> jobs(std::max(threads,1));
+        int nj = jobs.size(), b = 0;
+        // a single job draws from the caller's stream, several from their own
+        for(int i = 0; i < nj; i++) {
+            if(nj == 1) {
+                jobs[i].stream_ = seed;
+            } else {
+                jobs[i].seed_ = randSample(seed);
+                jobs[i].stream_ = &jobs[i].seed_;
             }
+            jobs[i].stren_ = stren; jobs[i].disc_ = disc;
         }
+        for(CountMap::const_iterator it = nodeTableCounts.begin(); it != nodeTableCounts.end(); it++)
+            jobs[b++ % nj].nodeTables_.push_back(*it);
         for(CountMap::const_iterator it = nodeCustCounts.begin(); it != nodeCustCounts.end(); it++)
-            for(int k = 0; k < it->second; k++)
-                sb -= log(betaSample(stren+1,it->first-1));
+            jobs[b++ % nj].nodeCusts_.push_back(*it);
         for(CountMap::const_iterator it = tableCustCounts.begin(); it != tableCustCounts.end(); it++)
-            for(int j = 1; j < it->first; j++)
-                for(int k = 0; k < it->second; k++)
-                    db += (1-bernoulliSample((j-1)/(j-disc)));
+            jobs[b++ % nj].tableCusts_.push_back(*it);
+        // calculate and add the auxiliary variables
+        if(nj == 1) {
+            jobs[0].run();
+        } else {
+            for(int i = 0; i < nj; i++)
+                pthread_create(&jobs[i].thread_, NULL, runPyAuxJob, (void*) &jobs[i]);
+            for(int i = 0; i < nj; i++)
+                pthread_join(jobs[i].thread_, NULL);
+        }
+        for(int i = 0; i < nj; i++) {
+            sa += jobs[i].sa_; sb += jobs[i].sb_;
+            da += jobs[i].da_; db += jobs[i].db_;
+        }
         // sample the new parameters and re-set the parameters of the distributions
-        pair<double,double> ret( gammaSample(sa,1/sb), betaSample(da,db) );
+        pair<double,double> ret( gammaSample(sa,1/sb,seed), betaSample(da,db,seed) );
         for(int i = 0; i < (int)dists.size(); i++) {
             dists[i]->setStrength(ret.first);
             dists[i]->setDiscount(ret.second);
@@ -268,14 +684,25 @@ public:
     }
     
     double getStrength() const { return stren_; }
-    void setStrength(double stren) { stren_ = stren; }
+    void setStrength(double stren) { stren_ = stren; updateCache(); }
     double getDiscount() const { return disc_; }
-    void setDiscount(double disc) { disc_ = disc; }
+    void setDiscount(double disc) { disc_ = disc; updateCache(); }
     int getTableCount() const { return tables_; }
+    int getCustomerCount() const { return customers_; }
+    // the number of tables of each size with more than one customer
+    const SizeCounts & getTableSizeCounts() const { return sizeCounts_; }
     bool tableAdded() const { return tableAdded_; }
     bool tableRemoved() const { return tableRemoved_; }
     bool isEmpty() const { return tables_ == 0; }
 
+    // the number of IDs with customers, and the approximate bytes used
+    int getEntryCount() const { return counts_.getEntryCount(); }
+    // add the IDs with customers to ids, in no particular order
+    void getIds(std::vector<int> & ids) const { counts_.getIds(ids); }
+    size_t getMemoryUsage() const {
+        return sizeof(*this)+counts_.getMemoryUsage()+sizeCounts_.getHeapBytes();
+    }
+
 };
 
 }
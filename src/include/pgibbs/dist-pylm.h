@@ -3,19 +3,308 @@
 
 #include "pgibbs/dist-py.h"
 #include <map>
+#include <numeric>
+#include <climits>
+#include <stdint.h>
+#include <atomic>
+#include <pthread.h>
+#include "gng/lock-stripes.h"
 
 namespace pgibbs {
 
-typedef map<int,int> ChildMap;
+typedef PyDist<PyAdaptiveIndex,PyHistTableSet> PYLMDist;
+
+// a link from a node to the child node for the next word in the context
+struct PYLMChild {
+    int wid_, node_;
+    bool operator<(const PYLMChild & rhs) const { return wid_ < rhs.wid_; }
+};
 
 class PYLMNode {
 
 public:
     int wid_, parent_;
-    ChildMap children_;
-    PyDist<PySparseIndex> dist_;
+    int level_, levelPos_; // the depth, and the position in its level's index
+    uint64_t stamp_; // when the node was allocated, or 0 if it is not in use
+    gng::SmallVector<PYLMChild,2> children_; // sorted by wid
+    PYLMDist dist_;
+
+    PYLMNode() : wid_(-1), parent_(-1), level_(0), levelPos_(0), stamp_(0), dist_(1.0,0.0) { }
+    PYLMNode(int wid, int parent, int level, double stren, double disc) : wid_(wid), parent_(parent), level_(level), levelPos_(0), stamp_(0), dist_(stren,disc) { }
+
+    int findChild(int wid) const {
+        PYLMChild key = { wid, 0 };
+        const PYLMChild* it = std::lower_bound(children_.begin(), children_.end(), key);
+        return (it != children_.end() && it->wid_ == wid) ? it->node_ : -1;
+    }
+    void addChild(int wid, int node) {
+        PYLMChild key = { wid, node };
+        children_.insert(std::lower_bound(children_.begin(), children_.end(), key), key);
+    }
+    void removeChild(int wid) {
+        PYLMChild key = { wid, 0 };
+        PYLMChild* it = std::lower_bound(children_.begin(), children_.end(), key);
+        if(it != children_.end() && it->wid_ == wid)
+            children_.erase(it);
+    }
+
+};
+
+#define PYLM_CHUNK_BITS 8
+#define PYLM_CHUNK_SIZE (1 << PYLM_CHUNK_BITS)
+#define PYLM_FREE_NODE -2
+
+// PYLM nodes stored by value in fixed-size chunks, so a node never moves
+//  once it is made, and only the directory of chunks has to grow. deleted
+//  nodes are kept in a free list that is linked through their wid_. every
+//  allocation gets a new stamp, so a node index can be checked to still
+//  hold the same node later. stamps are 64-bit so they never wrap and an
+//  old stamp can't come back, and are only comparable within one serial,
+//  which is new for every pool and every copy.
+// nodes are read through dir_, a pointer to the chunk directory. while the
+//  pool is shared by several threads, a full directory is copied instead of
+//  grown in place, and old copies are kept until release() so readers that
+//  still hold them stay valid. threads can also take slots in batches with
+//  reserve(), and fill them without locking with place()
+class PYLMNodePool {
+
+protected:
+    vector<PYLMNode*> chunks_;
+    std::atomic<PYLMNode**> dir_;
+    vector< vector<PYLMNode*> > retired_;
+    bool shared_;
+    int size_, free_, freeCount_;
+    std::atomic<uint64_t> stamp_;
+    unsigned serial_;
+
+    void addChunk() {
+        if(shared_ && chunks_.size() == chunks_.capacity()) {
+            vector<PYLMNode*> bigger;
+            bigger.reserve(chunks_.capacity()*2);
+            bigger.insert(bigger.end(), chunks_.begin(), chunks_.end());
+            retired_.push_back(vector<PYLMNode*>());
+            retired_.back().swap(chunks_);
+            chunks_.swap(bigger);
+        }
+        chunks_.push_back(new PYLMNode[PYLM_CHUNK_SIZE]);
+        dir_.store(&chunks_[0], std::memory_order_release);
+    }
+
+    static unsigned nextSerial() {
+        static std::atomic<unsigned> serial(0);
+        return ++serial;
+    }
+
+    // take an unused slot from the free list, or from the end of the pool
+    int take() {
+        int ret;
+        if(free_ != -1) {
+            ret = free_;
+            free_ = (*this)[ret].wid_;
+            freeCount_--;
+        } else {
+            if(size_ == (int)chunks_.size()*PYLM_CHUNK_SIZE)
+                addChunk();
+            ret = size_++;
+        }
+        return ret;
+    }
+
+public:
+    PYLMNodePool() : dir_(0), shared_(false), size_(0), free_(-1), freeCount_(0),
+                     stamp_(0), serial_(nextSerial()) {
+        chunks_.reserve(64);
+    }
+    PYLMNodePool(const PYLMNodePool & pool) : chunks_(pool.chunks_), dir_(0), shared_(false),
+                            size_(pool.size_), free_(pool.free_), freeCount_(pool.freeCount_),
+                            stamp_(pool.stamp_.load()), serial_(nextSerial()) {
+        chunks_.reserve(std::max(64, (int)chunks_.size()));
+        for(int i = 0; i < (int)chunks_.size(); i++) {
+            chunks_[i] = new PYLMNode[PYLM_CHUNK_SIZE];
+            std::copy(pool.chunks_[i], pool.chunks_[i]+PYLM_CHUNK_SIZE, chunks_[i]);
+        }
+        if(chunks_.size())
+            dir_.store(&chunks_[0]);
+    }
+    ~PYLMNodePool() {
+        for(int i = 0; i < (int)chunks_.size(); i++)
+            delete [] chunks_[i];
+    }
+    PYLMNodePool & operator=(const PYLMNodePool & pool) {
+        PYLMNodePool copy(pool);
+        chunks_.swap(copy.chunks_);
+        dir_.store(chunks_.size() ? &chunks_[0] : 0);
+        retired_.clear();
+        std::swap(size_, copy.size_);
+        std::swap(free_, copy.free_);
+        std::swap(freeCount_, copy.freeCount_);
+        stamp_.store(copy.stamp_.load());
+        std::swap(serial_, copy.serial_);
+        return *this;
+    }
+
+    PYLMNode & operator[](int i) {
+        return dir_.load(std::memory_order_acquire)[i >> PYLM_CHUNK_BITS][i & (PYLM_CHUNK_SIZE-1)];
+    }
+    const PYLMNode & operator[](int i) const {
+        return dir_.load(std::memory_order_acquire)[i >> PYLM_CHUNK_BITS][i & (PYLM_CHUNK_SIZE-1)];
+    }
+
+    // start or stop sharing the pool between threads. stopping must only
+    //  be done once no other thread is reading, and frees old directories
+    void setShared(bool shared) {
+        shared_ = shared;
+        if(!shared) retired_.clear();
+    }
+
+    // take num unused slots and add their indices to ids. a slot belongs to
+    //  the caller until it is filled with place() or given back with release()
+    void reserve(int num, vector<int> & ids) {
+        for(int k = 0; k < num; k++)
+            ids.push_back(take());
+    }
+
+    // store a new node in a reserved slot, giving it a new stamp
+    void place(int i, PYLMNode node) {
+        node.stamp_ = ++stamp_;
+        (*this)[i] = std::move(node);
+    }
+
+    // store a new node in an unused slot and return its index
+    int allocate(PYLMNode node) {
+        int ret = take();
+        place(ret, std::move(node));
+        return ret;
+    }
+
+    // clear a node, releasing its memory, and add it to the free list
+    void release(int i) {
+        PYLMNode & node = (*this)[i];
+        node = PYLMNode();
+        node.parent_ = PYLM_FREE_NODE;
+        node.wid_ = free_;
+        free_ = i;
+        freeCount_++;
+    }
+
+    // rebuild the pool with only the nodes in order, where order[i] becomes
+    //  node i. nodes are moved, so their distributions are not copied
+    void compact(const vector<int> & order) {
+        vector<PYLMNode*> chunks;
+        chunks.reserve(std::max(64, (int)chunks_.capacity()));
+        for(int i = 0; i < (int)order.size(); i++) {
+            if((i & (PYLM_CHUNK_SIZE-1)) == 0)
+                chunks.push_back(new PYLMNode[PYLM_CHUNK_SIZE]);
+            chunks.back()[i & (PYLM_CHUNK_SIZE-1)] = std::move((*this)[order[i]]);
+        }
+        for(int i = 0; i < (int)chunks_.size(); i++)
+            delete [] chunks_[i];
+        chunks_.swap(chunks);
+        dir_.store(&chunks_[0]);
+        size_ = order.size();
+        free_ = -1;
+        freeCount_ = 0;
+    }
+
+    bool isFree(int i) const { return (*this)[i].parent_ == PYLM_FREE_NODE; }
+    int size() const { return size_; }
+    uint64_t getStamp() const { return stamp_; }
+    unsigned getSerial() const { return serial_; }
+    int getFreeCount() const { return freeCount_; }
 
-    PYLMNode(int wid, int parent, double stren, double disc) : wid_(wid), parent_(parent), dist_(stren,disc) { }
+    // the bytes used by the chunks themselves, not memory owned by nodes
+    size_t getMemoryUsage() const {
+        return chunks_.capacity()*sizeof(PYLMNode*) + chunks_.size()*PYLM_CHUNK_SIZE*sizeof(PYLMNode);
+    }
+
+};
+
+#define PYLM_LOCK_STRIPES 1024
+
+// the sampling of the parameters of one or more levels of a PYLM
+class PYLMLevelJob {
+
+public:
+    pthread_t thread_;
+    unsigned seed_;
+    int threads_;
+    vector<int> levels_;
+    vector< vector<PYLMDist*> > dists_; // the distributions of each level
+    double sa_, sb_, da_, db_;
+    vector< pair<double,double> > pars_;
+
+    PYLMLevelJob() : seed_(0), threads_(1), sa_(0), sb_(0), da_(0), db_(0) { }
+
+    void run() {
+        pars_.resize(dists_.size());
+        for(int i = 0; i < (int)dists_.size(); i++)
+            pars_[i] = PYLMDist::sampleParameters(dists_[i],sa_,sb_,da_,db_,threads_,&seed_);
+    }
+
+};
+
+inline void* runPYLMLevelJob(void* ptr) {
+    ((PYLMLevelJob*)ptr)->run();
+    return NULL;
+}
+
+#define PYLM_NEXT_SLOTS 4096
+
+// a direct-mapped cache of the node that follows (node,wid), to be owned by
+//  a single thread. entries are not cleared when the LM changes, but
+//  checked against node stamps by PYLM::getNext before they are used
+class PYLMNextCache {
+
+public:
+
+    struct Entry {
+        int node_, wid_, next_;
+        uint64_t nodeStamp_, nextStamp_;
+        uint64_t limit_; // the last pool stamp for which the entry holds
+    };
+
+protected:
+
+    vector<Entry> entries_;
+    unsigned serial_;
+    long long hits_, lookups_;
+
+public:
+
+    PYLMNextCache() : serial_(0), hits_(0), lookups_(0) { }
+
+    // start using the cache for the node pool with the given serial,
+    //  forgetting the entries of any other pool
+    void bind(unsigned serial) {
+        if(serial == serial_) return;
+        Entry empty = { -1, -1, -1, 0, 0, 0 };
+        entries_.assign(PYLM_NEXT_SLOTS, empty);
+        serial_ = serial;
+    }
+
+    Entry & getEntry(int node, int wid) {
+        unsigned h = (unsigned)node*2654435761u ^ (unsigned)wid*2246822519u;
+        lookups_++;
+        return entries_[(h ^ (h >> 15)) & (PYLM_NEXT_SLOTS-1)];
+    }
+    void addHit() { hits_++; }
+
+    // get the number of hits and lookups
+    pair<long long,long long> getHitCounts() const { return make_pair(hits_, lookups_); }
+
+};
+
+#define PYLM_SPARE_NODES 32
+
+// what one thread changes in a PYLM while it is concurrent, kept apart so
+//  threads only share the pool lock to take a new batch of spare slots
+class PYLMThreadState {
+
+public:
+    vector<int> spare_;   // reserved node slots that are not used yet
+    vector<int> made_;    // nodes made, not yet in the index of their level
+    vector<int> pending_; // nodes that may have become empty
+    vector<int> emptied_; // words that lost their last customer
 
 };
 
@@ -24,52 +313,271 @@ class PYLM {
 protected:
     int n_;
 
-    vector<PYLMNode*> nodes_;
-    vector<int> reuse_;
+    PYLMNodePool nodes_;
     vector<double> strens_, discs_;
 
-public:
+    // locks used while the LM is concurrent. each node's distribution and
+    //  children are read and changed under its node lock, and no thread ever
+    //  holds two node locks at once. the pool lock is only taken by a thread
+    //  to register its state, or to reserve a batch of slots. the states of
+    //  the threads are merged when concurrency ends, and new nodes are only
+    //  indexed and empty ones deleted then. every concurrent period has a
+    //  new serial
+    mutable gng::LockStripes<PYLM_LOCK_STRIPES> nodeLocks_;
+    gng::LockStripes<1> poolLock_;
+    vector<PYLMThreadState*> states_;
+    unsigned serial_;
+
+    // the words whose last customer at the root left, which then have no
+    //  customers anywhere. they are kept until taken by the owner of the
+    //  word IDs, which can free them without searching every word
+    vector<int> emptied_;
+
+    // the nodes in use at each level, where each node knows its position
+    vector< vector<int> > levels_;
+
+    // the state of the calling thread in the current concurrent period
+    PYLMThreadState & getThreadState() {
+        static thread_local unsigned serial = 0;
+        static thread_local PYLMThreadState * state = 0;
+        if(serial != serial_) {
+            state = new PYLMThreadState;
+            poolLock_.lock(0);
+            states_.push_back(state);
+            poolLock_.unlock(0);
+            serial = serial_;
+        }
+        return *state;
+    }
 
-    PYLM() {
-        nodes_.push_back(new PYLMNode(-1,-1,1.0,0.0));
+    static unsigned nextSerial() {
+        static std::atomic<unsigned> serial(0);
+        return ++serial;
     }
 
-    PYLM(const PYLM & lm) : n_(lm.n_), nodes_(lm.nodes_), reuse_(lm.reuse_),
-                            strens_(lm.strens_), discs_(lm.discs_) {
-        for(int i = 0; i < (int)nodes_.size(); i++)
-            if(nodes_[i])
-                nodes_[i] = new PYLMNode(*nodes_[i]);
+    // add a node to the index of its level
+    void indexNode(int node) {
+        int level = nodes_[node].level_;
+        if((int)levels_.size() <= level)
+            levels_.resize(level+1);
+        nodes_[node].levelPos_ = levels_[level].size();
+        levels_[level].push_back(node);
+    }
+
+    // make a node, in a slot of the thread's own when concurrent
+    int allocateNode(const PYLMNode & node) {
+        if(!nodeLocks_.isActive()) {
+            int ret = nodes_.allocate(node);
+            indexNode(ret);
+            return ret;
+        }
+        PYLMThreadState & state = getThreadState();
+        if(state.spare_.empty()) {
+            poolLock_.lock(0);
+            nodes_.reserve(PYLM_SPARE_NODES, state.spare_);
+            poolLock_.unlock(0);
+        }
+        int ret = state.spare_.back();
+        state.spare_.pop_back();
+        nodes_.place(ret, node);
+        state.made_.push_back(ret);
+        return ret;
     }
 
+    // delete a node, moving the last node of its level into its position
+    void releaseNode(int node) {
+        vector<int> & level = levels_[nodes_[node].level_];
+        int pos = nodes_[node].levelPos_;
+        level[pos] = level.back();
+        nodes_[level[pos]].levelPos_ = pos;
+        level.pop_back();
+        nodes_.release(node);
+    }
+
+    // delete an empty node with no children, as it can't be reached
+    void releaseIfEmpty(int node) {
+        if(node != 0 && !nodes_.isFree(node) && nodes_[node].dist_.isEmpty() && nodes_[node].children_.size() == 0) {
+            removeChild(nodes_[node].parent_,nodes_[node].wid_);
+            releaseNode(node);
+        }
+    }
+
+public:
+
+    PYLM() : serial_(0) {
+        allocateNode(PYLMNode(-1,-1,0,1.0,0.0));
+    }
     ~PYLM() {
-        for(int i = 0; i < (int)nodes_.size(); i++)
-            if(nodes_[i])
-                delete nodes_[i];
+        for(int i = 0; i < (int)states_.size(); i++)
+            delete states_[i];
     }
 
-    int getNodeLevel(int node) {
-        if(node == 0) return 0;
-        return getNodeLevel(nodes_[node]->parent_)+1;
+    int getNodeLevel(int node) const { return nodes_[node].level_; }
+
+    int getLevelSize(int lev) const {
+        return (lev < (int)levels_.size() ? levels_[lev].size() : 0);
     }
 
-    int getLevelSize(int lev) {
-        int ret = 0;
-        for(int i = 0; i < (int)nodes_.size(); i++)
-            if(nodes_[i] && getNodeLevel(i) == lev)
-                ret++;
-        return ret;
+    // split threads between levels with the given numbers of distributions.
+    //  with enough threads, each non-empty level gets a job with one thread
+    //  plus a share of the rest in proportion to its size. otherwise there
+    //  is one job with one thread for each thread, and the levels are dealt
+    //  out largest first to the job with the fewest distributions. empty
+    //  levels get no job
+    static void splitThreads(const vector<int> & sizes, int threads, vector< vector<int> > & jobLevels, vector<int> & jobThreads) {
+        vector< pair<int,int> > order; // (-size, level), largest first
+        long long total = 0;
+        for(int i = 0; i < (int)sizes.size(); i++) {
+            if(sizes[i] == 0) continue;
+            order.push_back(pair<int,int>(-sizes[i], i));
+            total += sizes[i];
+        }
+        sort(order.begin(), order.end());
+        int nj = min(max(threads,1), (int)order.size());
+        jobLevels.assign(nj, vector<int>());
+        jobThreads.assign(nj, 1);
+        if(nj < (int)order.size()) {
+            vector<long long> load(nj, 0);
+            for(int k = 0; k < (int)order.size(); k++) {
+                int j = min_element(load.begin(), load.end()) - load.begin();
+                jobLevels[j].push_back(order[k].second);
+                load[j] -= order[k].first;
+            }
+            return;
+        }
+        int left = threads - nj;
+        for(int k = 0; k < nj; k++) {
+            jobLevels[k].push_back(order[k].second);
+            jobThreads[k] += (int)(left*(long long)-order[k].first/total);
+        }
+        for(int k = 0, used = accumulate(jobThreads.begin(), jobThreads.end(), 0); used < threads; k = (k+1) % nj, used++)
+            jobThreads[k]++;
+    }
+
+    // sample the parameters of each level. with several threads, the levels
+    //  are sampled at once, each job with its share of the threads and its
+    //  own random seed. empty levels have nothing to sample from, and keep
+    //  their parameters
+    void sampleParameters(double sa, double sb, double da, double db, int threads = 1) {
+        vector<int> sizes(n_);
+        for(int i = 0; i < n_; i++)
+            sizes[i] = getLevelSize(i);
+        if(threads <= 1) {
+            // in level order, drawing from rand()
+            for(int i = 0; i < n_; i++) {
+                if(sizes[i] == 0) continue;
+                vector<PYLMDist*> dists;
+                for(int j = 0; j < (int)levels_[i].size(); j++)
+                    dists.push_back(&nodes_[levels_[i][j]].dist_);
+                pair<double,double> par = PYLMDist::sampleParameters(dists,sa,sb,da,db,1);
+                strens_[i] = par.first; discs_[i] = par.second;
+            }
+            return;
+        }
+        vector< vector<int> > jobLevels;
+        vector<int> jobThreads;
+        splitThreads(sizes, threads, jobLevels, jobThreads);
+        vector<PYLMLevelJob> jobs(jobLevels.size());
+        for(int j = 0; j < (int)jobs.size(); j++) {
+            jobs[j].levels_ = jobLevels[j];
+            jobs[j].dists_.resize(jobLevels[j].size());
+            for(int k = 0; k < (int)jobLevels[j].size(); k++) {
+                const vector<int> & level = levels_[jobLevels[j][k]];
+                for(int i = 0; i < (int)level.size(); i++)
+                    jobs[j].dists_[k].push_back(&nodes_[level[i]].dist_);
+            }
+            jobs[j].sa_ = sa; jobs[j].sb_ = sb; jobs[j].da_ = da; jobs[j].db_ = db;
+            jobs[j].threads_ = jobThreads[j];
+        }
+        for(int j = 0; j < (int)jobs.size(); j++)
+            jobs[j].seed_ = randSample();
+        for(int j = 0; j < (int)jobs.size(); j++)
+            pthread_create(&jobs[j].thread_, NULL, runPYLMLevelJob, (void*) &jobs[j]);
+        for(int j = 0; j < (int)jobs.size(); j++)
+            pthread_join(jobs[j].thread_, NULL);
+        for(int j = 0; j < (int)jobs.size(); j++) {
+            for(int k = 0; k < (int)jobs[j].levels_.size(); k++) {
+                strens_[jobs[j].levels_[k]] = jobs[j].pars_[k].first;
+                discs_[jobs[j].levels_[k]] = jobs[j].pars_[k].second;
+            }
+        }
     }
 
-    void sampleParameters(double sa, double sb, double da, double db) {
-        vector< vector< PyDist<PySparseIndex>* > > dists(n_);
-        for(int i = 0; i < (int)nodes_.size(); i++) 
-            if(nodes_[i] != 0) {
-                // cerr << "pushing back at " << getNodeLevel(i) << "/"<<n_ << endl;
-                dists[getNodeLevel(i)].push_back(&nodes_[i]->dist_);
+    // allow (or stop allowing) addCust, removeCust, getChild, getNext and
+    //  getProb to be called from several threads at once. nodes that become
+    //  empty are kept until concurrency is turned off, so no thread can be
+    //  left holding a deleted node. no other function may be called while
+    //  the LM is concurrent
+    void setConcurrent(bool conc) {
+        if(conc == nodeLocks_.isActive()) return;
+        nodeLocks_.setActive(conc);
+        poolLock_.setActive(conc);
+        nodes_.setShared(conc);
+        if(conc) {
+            serial_ = nextSerial();
+            return;
+        }
+        // index the new nodes and give back the unused slots before any
+        //  node is deleted, then merge the words and delete empty nodes
+        for(int i = 0; i < (int)states_.size(); i++) {
+            PYLMThreadState & state = *states_[i];
+            for(int j = 0; j < (int)state.made_.size(); j++)
+                indexNode(state.made_[j]);
+            for(int j = 0; j < (int)state.spare_.size(); j++)
+                nodes_.release(state.spare_[j]);
+            emptied_.insert(emptied_.end(), state.emptied_.begin(), state.emptied_.end());
+        }
+        for(int i = 0; i < (int)states_.size(); i++) {
+            PYLMThreadState & state = *states_[i];
+            for(int j = 0; j < (int)state.pending_.size(); j++)
+                releaseIfEmpty(state.pending_[j]);
+            delete states_[i];
+        }
+        states_.clear();
+    }
+    bool isConcurrent() const { return nodeLocks_.isActive(); }
+
+    // renumber the nodes in breadth-first order, so the children of each
+    //  node are next to each other, and drop nodes with no customers below
+    //  them. nodes in refs are always kept, and are changed to their new IDs
+    void compact(vector<int> & refs) {
+        int size = nodes_.size();
+        vector<char> keep(size, 0);
+        keep[0] = 1;
+        for(int i = 1; i < size; i++)
+            if(!nodes_.isFree(i) && !nodes_[i].dist_.isEmpty())
+                for(int k = i; !keep[k]; k = nodes_[k].parent_)
+                    keep[k] = 1;
+        for(int j = 0; j < (int)refs.size(); j++)
+            for(int k = refs[j]; !keep[k]; k = nodes_[k].parent_)
+                keep[k] = 1;
+        vector<int> order(1, 0), newId(size, -1);
+        newId[0] = 0;
+        for(int i = 0; i < (int)order.size(); i++) {
+            PYLMNode & node = nodes_[order[i]];
+            gng::SmallVector<PYLMChild,2> children;
+            for(int j = 0; j < (int)node.children_.size(); j++) {
+                PYLMChild child = node.children_[j];
+                if(!keep[child.node_]) continue;
+                newId[child.node_] = order.size();
+                order.push_back(child.node_);
+                child.node_ = newId[child.node_];
+                children.push_back(child);
             }
-        for(int i = 0; i < n_; i++) {
-            pair<double,double> newPar = PyDist<PySparseIndex>::sampleParameters(dists[i],sa,sb,da,db);
-            strens_[i] = newPar.first; discs_[i] = newPar.second;
+            node.children_.swap(children);
+            if(i != 0)
+                node.parent_ = newId[node.parent_];
+        }
+        nodes_.compact(order);
+        for(int i = 0; i < (int)refs.size(); i++)
+            refs[i] = newId[refs[i]];
+        // the nodes are in breadth-first order, so each level is in order
+        for(int i = 0; i < (int)levels_.size(); i++)
+            levels_[i].clear();
+        for(int i = 0; i < (int)order.size(); i++) {
+            PYLMNode & node = nodes_[i];
+            node.levelPos_ = levels_[node.level_].size();
+            levels_[node.level_].push_back(i);
         }
     }
 
@@ -81,117 +589,182 @@ public:
     }
     
     int getNext(int node, int wid) const {
-        return const_cast<PYLM*>(this)->getNext(node,wid,false);
+        bool full;
+        return const_cast<PYLM*>(this)->getNext(node,wid,false,full);
+    }
+    int getNext(int node, int wid, bool add) {
+        bool full;
+        return getNext(node,wid,add,full);
     }
 
-    // get a pointer to the next node in order
-    int getNext(int node, int wid, bool add) { 
+    // get the node for the context of node followed by wid, or the longest
+    //  existing suffix of it, where full is set if the whole context exists
+    int getNext(int node, int wid, bool add, bool & full) {
+        full = true;
         if(wid < 0) return 0;
-        list<int> context;
-        while(node != 0) {
-            context.push_front(nodes_[node]->wid_);
-            node = nodes_[node]->parent_;
-        }
-        context.push_front(wid);
-        while((int)context.size() > n_-1)
-            context.pop_back();
-        int lev = 0;
-        for(list<int>::iterator it = context.begin(); it != context.end(); it++) {
-            int next = getChild(node,*it,add,strens_[lev],discs_[lev]);
-            lev++;
-            if(next < 0) return node;
+        // the words of the context from the oldest, so the newest is at the back
+        gng::SmallVector<int,8> context;
+        for( ; node != 0; node = nodes_[node].parent_)
+            context.push_back(nodes_[node].wid_);
+        context.push_back(wid);
+        int len = min((int)context.size(), n_-1);
+        for(int lev = 0; lev < len; lev++) {
+            int next = getChild(node,context[context.size()-1-lev],add,strens_[lev],discs_[lev]);
+            if(next < 0) { full = false; return node; }
             node = next;
         }
         return node;
     }
 
+    // get the next node, first looking in the cache. a full match stays
+    //  correct as long as both nodes are alive, but a partial match only
+    //  until a new node is made that might extend it. compaction can leave
+    //  entries pointing past the end of the pool, which are misses
+    int getNext(int node, int wid, PYLMNextCache & cache) const {
+        if(wid < 0) return 0;
+        cache.bind(nodes_.getSerial());
+        PYLMNextCache::Entry & entry = cache.getEntry(node,wid);
+        if(entry.node_ == node && entry.wid_ == wid && nodes_.getStamp() <= entry.limit_ &&
+           entry.next_ < nodes_.size() && nodes_[node].stamp_ == entry.nodeStamp_ &&
+           nodes_[entry.next_].stamp_ == entry.nextStamp_) {
+            cache.addHit();
+            return entry.next_;
+        }
+        bool full;
+        int next = const_cast<PYLM*>(this)->getNext(node,wid,false,full);
+        PYLMNextCache::Entry myEntry = { node, wid, next, nodes_[node].stamp_, nodes_[next].stamp_,
+                                         full ? ~(uint64_t)0 : nodes_.getStamp() };
+        entry = myEntry;
+        return next;
+    }
+
     // add a child node
     int getChild(int node, int wid, bool add, double stren, double disc) {
 #ifdef DEBUG_ON
         if(node < 0 || node >= (int)nodes_.size())
             THROW_ERROR("Getting invalid node: "<<node<<" (nodes.size="<<nodes_.size()<<")");
 #endif
-        ChildMap & myMap = nodes_[node]->children_;
-        ChildMap::const_iterator it = myMap.find(wid);
-        if(it == myMap.end()) {
-            if(!add) return -1;
-            int ret;
-            if(reuse_.size() != 0) {
-                ret = reuse_.back(); reuse_.pop_back();      
-            } else {
-                ret = nodes_.size(); nodes_.push_back(0);
-            }
-            myMap.insert(pair<int,int>(wid,ret));
-            nodes_[ret] = new PYLMNode(wid,node,stren,disc);
-            return ret;
+        nodeLocks_.lock(node);
+        int ret = nodes_[node].findChild(wid);
+        if(ret == -1 && add) {
+            ret = allocateNode(PYLMNode(wid,node,nodes_[node].level_+1,stren,disc));
+            nodes_[node].addChild(wid,ret);
         }
-        return it->second;
+        nodeLocks_.unlock(node);
+        return ret;
     }
 
-    // TODO: BAD IMPLEMENTATION, cache the probabilities
-    double addCust(int node, int wid, double base) {
+    // get the nodes from node up to the root, and the probability of wid at
+    //  each of them before any change, where probs[i] is at chain[i]
+    void getChain(int node, int wid, double base, gng::SmallVector<int,8> & chain, gng::SmallVector<double,8> & probs) const {
+        for( ; node != 0; node = nodes_[node].parent_)
+            chain.push_back(node);
+        chain.push_back(0);
+        for(int i = 0; i < (int)chain.size(); i++)
+            probs.push_back(0);
+        for(int i = chain.size()-1; i >= 0; i--) {
+            nodeLocks_.lock(chain[i]);
+            base = nodes_[chain[i]].dist_.getProb(wid,base);
+            nodeLocks_.unlock(chain[i]);
+            probs[i] = base;
+        }
+    }
+
+    // add a customer and return its probability, where the parent
+    //  probabilities are calculated once and new tables move up the chain.
+    //  seating draws from rand(), or from rand_r if seed is given
+    double addCust(int node, int wid, double base, unsigned * seed = 0) {
 #ifdef DEBUG_ON
         if(node < 0 || node >= (int)nodes_.size())
             THROW_ERROR("Adding customer to invalid node: "<<node<<" (nodes.size="<<nodes_.size()<<")");
 #endif
-        // cerr << "added to "<<wid<<"@"<<node<<": ";
-        if(node != 0) {
-            double newBase = getProb(nodes_[node]->parent_,wid,base);
-            double prob = nodes_[node]->dist_.add(wid,newBase);
-            if(nodes_[node]->dist_.tableAdded())
-                addCust(nodes_[node]->parent_,wid,base);
-            return prob;
-        } else {
-            return nodes_[node]->dist_.add(wid,base);
+        gng::SmallVector<int,8> chain;
+        gng::SmallVector<double,8> probs;
+        getChain(node,wid,base,chain,probs);
+        int cs = chain.size();
+        double ret = 0;
+        for(int i = 0; i < cs; i++) {
+            PYLMDist & dist = nodes_[chain[i]].dist_;
+            nodeLocks_.lock(chain[i]);
+            double prob = dist.add(wid,(i+1 < cs ? probs[i+1] : base),seed);
+            bool added = dist.tableAdded();
+            nodeLocks_.unlock(chain[i]);
+            if(i == 0) ret = prob;
+            if(!added) break;
         }
+        return ret;
     }
 
     void removeChild(int node, int wid) {
-        if(nodes_[node] == NULL) return;
-        nodes_[node]->children_.erase(wid);
+        if(nodes_.isFree(node)) return;
+        nodes_[node].removeChild(wid);
     }
 
-    double removeCust(int node, int wid, double base) {
+    // remove a customer and return the probability of wid afterwards
+    double removeCust(int node, int wid, double base, unsigned * seed = 0) {
 #ifdef DEBUG_ON
         if(node < 0 || node >= (int)nodes_.size())
             THROW_ERROR("Removing customer from invalid node: "<<node<<" (nodes.size="<<nodes_.size()<<")");
 #endif
-        // cerr << "removeCust("<<node<<","<<wid<<","<<base<<")"<<endl;
-        if(node != 0) {
-            double newBase = getProb(nodes_[node]->parent_,wid,base);
-            double prob = nodes_[node]->dist_.remove(wid,newBase);
-            if(nodes_[node]->dist_.tableRemoved()) {
-                newBase = removeCust(nodes_[node]->parent_,wid,base);
-                prob = nodes_[node]->dist_.getProb(wid,newBase);
-            }
-            if(nodes_[node]->dist_.isEmpty() && nodes_[node]->children_.size() == 0) {
-                removeChild(nodes_[node]->parent_,nodes_[node]->wid_);
-                delete nodes_[node];
-                nodes_[node] = NULL;
-                reuse_.push_back(node);
-            }
-            return prob;
-        } else {
-            return nodes_[node]->dist_.remove(wid,base);
+        gng::SmallVector<int,8> chain;
+        gng::SmallVector<double,8> probs;
+        getChain(node,wid,base,chain,probs);
+        int cs = chain.size(), last = 0;
+        bool emptied = false;
+        for( ; last < cs; last++) {
+            PYLMDist & dist = nodes_[chain[last]].dist_;
+            nodeLocks_.lock(chain[last]);
+            dist.remove(wid,0,seed);
+            bool removed = dist.tableRemoved();
+            if(last == cs-1) emptied = (dist.getTotal(wid) == 0);
+            nodeLocks_.unlock(chain[last]);
+            if(!removed) break;
         }
-
+        if(emptied)
+            (nodeLocks_.isActive() ? getThreadState().emptied_ : emptied_).push_back(wid);
+        // recalculate the probabilities of the changed nodes from the top
+        double prob = (last+1 < cs ? probs[last+1] : base);
+        for(int i = min(last,cs-1); i >= 0; i--) {
+            nodeLocks_.lock(chain[i]);
+            prob = nodes_[chain[i]].dist_.getProb(wid,prob);
+            nodeLocks_.unlock(chain[i]);
+        }
+        if(!nodeLocks_.isActive())
+            releaseIfEmpty(node);
+        else if(node != 0)
+            getThreadState().pending_.push_back(node);
+        return prob;
     }
 
-    // get the probability
+    // get the probability, accumulating the contribution of each node from
+    //  the bottom up as p = c_0 + f_0*(c_1 + f_1*(... + f_k*base))
     double getProb(int node, int wid, double base) const {
 #ifdef DEBUG_ON
         if(node < 0 || node >= (int)nodes_.size())
             THROW_ERROR("Getting probability of invalid node: "<<node<<" (nodes.size="<<nodes_.size()<<")");
-        if(nodes_[node] == 0)
+        if(nodes_.isFree(node))
             THROW_ERROR("Attempting to use null node at "<<node);
 #endif
-        if(node != 0)
-            base = getProb(nodes_[node]->parent_,wid,base);
-        return nodes_[node]->dist_.getProb(wid,base);
+        double ret = 0, mult = 1;
+        while(true) {
+            const PYLMDist & dist = nodes_[node].dist_;
+            nodeLocks_.lock(node);
+            ret += mult*dist.getCountProb(wid);
+            mult *= dist.getFallbackProb();
+            nodeLocks_.unlock(node);
+            if(node == 0) break;
+            node = nodes_[node].parent_;
+        }
+        return ret+mult*base;
     }
 
+    // whether there are no customers. the root and any nodes held by the
+    //  caller, such as the context of the sentence start, are never freed
     bool isEmpty() const {
-        return nodes_.size() == reuse_.size();
+        for(int i = 0; i < (int)nodes_.size(); i++)
+            if(!nodes_.isFree(i) && !nodes_[i].dist_.isEmpty())
+                return false;
+        return true;
     }
 
     double getStrength(int i) { return strens_[i]; }
@@ -199,9 +772,23 @@ public:
     void setStrength(int i, double s) { strens_[i] = s; }
     void setDisc(int i, double s) { discs_[i] = s; }
 
+    // read the structure of the LM, for exporting it
+    int getParent(int node) const { return nodes_[node].parent_; }
+    int getContextWord(int node) const { return nodes_[node].wid_; }
+    double getFallbackProb(int node) const { return nodes_[node].dist_.getFallbackProb(); }
+    const gng::SmallVector<PYLMChild,2> & getChildren(int node) const { return nodes_[node].children_; }
+    void getWords(int node, vector<int> & wids) const { nodes_[node].dist_.getIds(wids); }
+
+    // take the words that lost their last customer since the last call. a
+    //  word may be listed more than once, and may have customers again
+    void takeEmptiedWords(vector<int> & words) {
+        words.clear();
+        words.swap(emptied_);
+    }
+
     // get the number of customers for an ID
     int getCustCount(int node, int wid) const {
-        return nodes_[node]->dist_.getTotal(wid);
+        return nodes_[node].dist_.getTotal(wid);
     }
     // int getTableCount(int node) const { return dist_.getTableCount(); }
 
@@ -209,6 +796,138 @@ public:
         return nodes_.size();
     }
 
+    // get the approximate memory usage in bytes, and the number of
+    //  (context,word) entries over all nodes
+    size_t getMemoryUsage(int & entries) const {
+        size_t ret = nodes_.getMemoryUsage();
+        entries = 0;
+        for(int i = 0; i < nodes_.size(); i++) {
+            if(nodes_.isFree(i)) continue;
+            ret += nodes_[i].dist_.getMemoryUsage()-sizeof(PYLMDist)+nodes_[i].children_.getHeapBytes();
+            entries += nodes_[i].dist_.getEntryCount();
+        }
+        return ret;
+    }
+
+};
+
+#define PYLM_MEMO_SHARDS 64
+#define PYLM_MEMO_SLOTS 1024
+
+// a memo of the probability and next node of (node,wid) pairs while the LM
+//  is not changing, for example while a block is sampled. it is split into
+//  shards with their own locks so it can be shared by all sampling threads,
+//  and each shard is a direct-mapped table where new entries overwrite old
+//  ones. entries are cleared all at once by advancing the generation
+class PYLMMemo {
+
+protected:
+
+    struct Entry {
+        unsigned gen_;
+        int node_, wid_, next_;
+        double prob_;
+    };
+
+    struct Shard {
+        pthread_mutex_t mutex_;
+        vector<Entry> entries_;
+        long long hits_, lookups_;
+    };
+
+    Shard shards_[PYLM_MEMO_SHARDS];
+    unsigned gen_;
+    bool active_, shared_;
+
+    void init() {
+        Entry empty = { 0, -1, -1, -1, 0.0 };
+        for(int i = 0; i < PYLM_MEMO_SHARDS; i++) {
+            pthread_mutex_init(&shards_[i].mutex_, NULL);
+            shards_[i].entries_ = vector<Entry>(PYLM_MEMO_SLOTS, empty);
+            shards_[i].hits_ = shards_[i].lookups_ = 0;
+        }
+    }
+
+    void lock(Shard & shard) { if(shared_) pthread_mutex_lock(&shard.mutex_); }
+    void unlock(Shard & shard) { if(shared_) pthread_mutex_unlock(&shard.mutex_); }
+
+public:
+
+    PYLMMemo() : gen_(1), active_(false), shared_(false) { init(); }
+    // copies start with an empty memo
+    PYLMMemo(const PYLMMemo &) : gen_(1), active_(false), shared_(false) { init(); }
+    ~PYLMMemo() {
+        for(int i = 0; i < PYLM_MEMO_SHARDS; i++)
+            pthread_mutex_destroy(&shards_[i].mutex_);
+    }
+    PYLMMemo & operator=(const PYLMMemo &) {
+        clear();
+        return *this;
+    }
+
+    // start using the memo for an LM that won't change until the next clear,
+    //  with locking if it will be used by several threads at once
+    void activate(bool shared) {
+        active_ = true;
+        shared_ = shared;
+    }
+
+    // forget all entries and stop using the memo
+    void clear() {
+        active_ = false;
+        if(++gen_ == 0) {
+            for(int i = 0; i < PYLM_MEMO_SHARDS; i++)
+                for(int j = 0; j < PYLM_MEMO_SLOTS; j++)
+                    shards_[i].entries_[j].gen_ = 0;
+            gen_ = 1;
+        }
+    }
+
+    // get the probability of wid after node, and the node that follows it,
+    //  which is found through the calling thread's cache if one is given
+    double getProb(const PYLM & lm, int node, int wid, double base, int & next, PYLMNextCache * cache = 0) {
+        if(!active_ || wid < 0) {
+            next = (cache ? lm.getNext(node,wid,*cache) : lm.getNext(node,wid));
+            return lm.getProb(node,wid,base);
+        }
+        unsigned h = (unsigned)node*2654435761u ^ (unsigned)wid*2246822519u;
+        h ^= h >> 15;
+        Shard & shard = shards_[h & (PYLM_MEMO_SHARDS-1)];
+        Entry & entry = shard.entries_[(h >> 6) & (PYLM_MEMO_SLOTS-1)];
+        lock(shard);
+        shard.lookups_++;
+        if(entry.gen_ == gen_ && entry.node_ == node && entry.wid_ == wid) {
+            shard.hits_++;
+            next = entry.next_;
+            double prob = entry.prob_;
+            unlock(shard);
+            return prob;
+        }
+        unlock(shard);
+        // calculate outside of the lock, as the LM is not changing
+        next = (cache ? lm.getNext(node,wid,*cache) : lm.getNext(node,wid));
+        double prob = lm.getProb(node,wid,base);
+        lock(shard);
+        Entry myEntry = { gen_, node, wid, next, prob };
+        entry = myEntry;
+        unlock(shard);
+        return prob;
+    }
+
+    // get the number of hits and lookups since the last reset
+    pair<long long,long long> getHitCounts() const {
+        pair<long long,long long> ret(0,0);
+        for(int i = 0; i < PYLM_MEMO_SHARDS; i++) {
+            ret.first += shards_[i].hits_;
+            ret.second += shards_[i].lookups_;
+        }
+        return ret;
+    }
+    void resetHitCounts() {
+        for(int i = 0; i < PYLM_MEMO_SHARDS; i++)
+            shards_[i].hits_ = shards_[i].lookups_ = 0;
+    }
+
 };
 
 }
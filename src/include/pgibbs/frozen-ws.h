@@ -0,0 +1,345 @@
+#ifndef FROZEN_WS_H__
+#define FROZEN_WS_H__
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pgibbs/definitions.h"
+#include "gng/perfect-hash.h"
+#include "gng/small-vector.h"
+
+using namespace std;
+
+namespace pgibbs {
+
+// the contents of a frozen model before it is written. words, characters
+//  and nodes are numbered from 0, and node 0 is the root of the LM
+struct WSFrozenData {
+
+    // a word in a context, with its smoothed probability if it has
+    //  customers there (-1 otherwise), and the child node for it (or -1)
+    struct Entry {
+        int node_, wid_, child_;
+        double prob_;
+    };
+
+    int n_, maxLen_, initId_, initNode_;
+    vector<double> bases_;           // the base probability of each length
+    vector<string> chars_;           // the string of each character
+    vector< vector<int> > words_;    // the characters of each word
+    vector<int> parents_, contexts_; // the parent and context word of each node
+    vector<double> fallbacks_;       // the fallback probability of each node
+    vector<Entry> entries_;
+
+};
+
+// a read-only word segmentation model that is mapped from a file, so it
+//  loads without parsing and several processes can share its pages. the
+//  file is a header followed by flat arrays, each padded to 8 bytes:
+//   bases, char keys, char displacements, char offsets, char text,
+//   word keys, word displacements, word offsets, word text,
+//   node parents, node contexts, node fallbacks,
+//   entry keys, entry displacements, entry probabilities, entry children
+//  characters, words and (node,word) entries are found with minimal perfect
+//  hashes, and are numbered by their slot. each entry holds the smoothed
+//  probability of the word in the context, so no seating arrangements are
+//  kept, and words without customers in a context back off to the parent
+class WSFrozenModel {
+
+public:
+
+    struct Header {
+        char magic_[8];
+        int n_, maxLen_, initId_, initNode_;
+        int chars_, charBuckets_, charText_;
+        int words_, wordBuckets_, wordText_;
+        int nodes_, entries_, entryBuckets_;
+        int pad_;
+    };
+
+protected:
+
+    const char* data_;
+    size_t size_;
+    const Header* head_;
+    const double* bases_;
+    const uint64_t* charKeys_;
+    const uint32_t* charDisp_;
+    const int* charOffs_;
+    const char* charText_;
+    const uint64_t* wordKeys_;
+    const uint32_t* wordDisp_;
+    const int* wordOffs_;
+    const int* wordText_;
+    const int* parents_;
+    const int* contexts_;
+    const double* fallbacks_;
+    const uint64_t* entryKeys_;
+    const uint32_t* entryDisp_;
+    const double* entryProbs_;
+    const int* entryChildren_;
+
+    // the models are mapped, so they are not copied
+    WSFrozenModel(const WSFrozenModel & mod);
+    WSFrozenModel & operator=(const WSFrozenModel & mod);
+
+    static size_t padded(size_t bytes) { return (bytes+7) & ~(size_t)7; }
+
+    // point to the next array in the file, and move past it
+    template <class T>
+    const T* section(size_t & off, size_t count) const {
+        const T* ret = (const T*)(data_+off);
+        off += padded(count*sizeof(T));
+        return ret;
+    }
+    template <class T>
+    static void writeSection(ostream & out, const vector<T> & vec) {
+        size_t bytes = vec.size()*sizeof(T);
+        if(bytes) out.write((const char*)&vec[0], bytes);
+        for( ; bytes % 8; bytes++) out.put(0);
+    }
+
+    // find the slot of a key, or -1 if it is not in the table
+    static int findKey(uint64_t key, const uint64_t* keys, const uint32_t* disp, int buckets, int slots) {
+        int s = gng::PerfectHash::find(key, disp, buckets, slots);
+        return (s >= 0 && keys[s] == key) ? s : -1;
+    }
+
+    void unload() {
+        if(data_) munmap((void*)data_, size_);
+        data_ = 0; size_ = 0; head_ = 0;
+    }
+
+public:
+
+    WSFrozenModel() : data_(0), size_(0), head_(0) { }
+    ~WSFrozenModel() { unload(); }
+
+    static uint64_t hashString(const char* str, int len) {
+        uint64_t h = 14695981039346656037ULL;
+        for(int i = 0; i < len; i++)
+            h = (h ^ (unsigned char)str[i]) * 1099511628211ULL;
+        return h;
+    }
+    static uint64_t hashWord(const int* chars, int len) {
+        uint64_t h = 14695981039346656037ULL ^ (uint64_t)len;
+        for(int i = 0; i < len; i++)
+            h = (h ^ (uint32_t)chars[i]) * 1099511628211ULL;
+        return h;
+    }
+    static uint64_t entryKey(int node, int wid) {
+        return ((uint64_t)(uint32_t)node << 32) | (uint32_t)wid;
+    }
+
+    // write a model, renumbering the characters, words and entries by
+    //  the slots of their perfect hashes
+    static void write(const WSFrozenData & data, const string & fileName) {
+        int nc = data.chars_.size(), nw = data.words_.size(), nn = data.parents_.size(), ne = data.entries_.size();
+        // characters
+        vector<uint64_t> keys(nc), charKeys(nc);
+        vector<uint32_t> charDisp;
+        vector<int> charSlots, charOffs(1, 0);
+        for(int i = 0; i < nc; i++)
+            keys[i] = hashString(data.chars_[i].c_str(), data.chars_[i].length());
+        gng::PerfectHash::build(keys, charDisp, charSlots);
+        vector<int> bySlot(nc);
+        for(int i = 0; i < nc; i++) {
+            charKeys[charSlots[i]] = keys[i];
+            bySlot[charSlots[i]] = i;
+        }
+        vector<char> charText;
+        for(int s = 0; s < nc; s++) {
+            const string & str = data.chars_[bySlot[s]];
+            charText.insert(charText.end(), str.begin(), str.end());
+            charOffs.push_back(charText.size());
+        }
+        // words, spelled with the new characters
+        vector< vector<int> > words(data.words_);
+        keys.resize(nw);
+        for(int i = 0; i < nw; i++) {
+            for(int j = 0; j < (int)words[i].size(); j++)
+                words[i][j] = charSlots[words[i][j]];
+            keys[i] = hashWord(words[i].size() ? &words[i][0] : 0, words[i].size());
+        }
+        vector<uint64_t> wordKeys(nw);
+        vector<uint32_t> wordDisp;
+        vector<int> wordSlots, wordOffs(1, 0), wordText;
+        gng::PerfectHash::build(keys, wordDisp, wordSlots);
+        bySlot.resize(nw);
+        for(int i = 0; i < nw; i++) {
+            wordKeys[wordSlots[i]] = keys[i];
+            bySlot[wordSlots[i]] = i;
+        }
+        for(int s = 0; s < nw; s++) {
+            const vector<int> & word = words[bySlot[s]];
+            wordText.insert(wordText.end(), word.begin(), word.end());
+            wordOffs.push_back(wordText.size());
+        }
+        // nodes, with the new words as their contexts
+        vector<int> contexts(nn);
+        for(int i = 0; i < nn; i++)
+            contexts[i] = (data.contexts_[i] < 0 ? -1 : wordSlots[data.contexts_[i]]);
+        // entries
+        keys.resize(ne);
+        for(int i = 0; i < ne; i++)
+            keys[i] = entryKey(data.entries_[i].node_, wordSlots[data.entries_[i].wid_]);
+        vector<uint64_t> entryKeys(ne);
+        vector<uint32_t> entryDisp;
+        vector<int> entrySlots, entryChildren(ne);
+        vector<double> entryProbs(ne);
+        gng::PerfectHash::build(keys, entryDisp, entrySlots);
+        for(int i = 0; i < ne; i++) {
+            int s = entrySlots[i];
+            entryKeys[s] = keys[i];
+            entryProbs[s] = data.entries_[i].prob_;
+            entryChildren[s] = data.entries_[i].child_;
+        }
+        // write the header and arrays
+        Header head;
+        memset(&head, 0, sizeof(head));
+        memcpy(head.magic_, "PGWSFRZ1", 8);
+        head.n_ = data.n_; head.maxLen_ = data.maxLen_;
+        head.initId_ = wordSlots[data.initId_]; head.initNode_ = data.initNode_;
+        head.chars_ = nc; head.charBuckets_ = charDisp.size(); head.charText_ = charText.size();
+        head.words_ = nw; head.wordBuckets_ = wordDisp.size(); head.wordText_ = wordText.size();
+        head.nodes_ = nn; head.entries_ = ne; head.entryBuckets_ = entryDisp.size();
+        ofstream out(fileName.c_str(), ios::out | ios::binary);
+        if(!out)
+            THROW_ERROR("could not open frozen model file " << fileName << " for writing");
+        out.write((const char*)&head, sizeof(head));
+        writeSection(out, data.bases_);
+        writeSection(out, charKeys); writeSection(out, charDisp); writeSection(out, charOffs); writeSection(out, charText);
+        writeSection(out, wordKeys); writeSection(out, wordDisp); writeSection(out, wordOffs); writeSection(out, wordText);
+        writeSection(out, data.parents_); writeSection(out, contexts); writeSection(out, data.fallbacks_);
+        writeSection(out, entryKeys); writeSection(out, entryDisp); writeSection(out, entryProbs); writeSection(out, entryChildren);
+        if(!out)
+            THROW_ERROR("could not write frozen model file " << fileName);
+    }
+
+    // map a model from a file
+    void load(const string & fileName) {
+        unload();
+        int fd = open(fileName.c_str(), O_RDONLY);
+        if(fd < 0)
+            THROW_ERROR("could not find frozen model file " << fileName);
+        struct stat st;
+        if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+            close(fd);
+            THROW_ERROR("frozen model file " << fileName << " is too short");
+        }
+        void* map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED)
+            THROW_ERROR("could not map frozen model file " << fileName);
+        data_ = (const char*)map;
+        size_ = st.st_size;
+        head_ = (const Header*)data_;
+        if(memcmp(head_->magic_, "PGWSFRZ1", 8) != 0) {
+            unload();
+            THROW_ERROR(fileName << " is not a frozen model file");
+        }
+        size_t off = sizeof(Header);
+        bases_ = section<double>(off, head_->maxLen_+1);
+        charKeys_ = section<uint64_t>(off, head_->chars_);
+        charDisp_ = section<uint32_t>(off, head_->charBuckets_);
+        charOffs_ = section<int>(off, head_->chars_+1);
+        charText_ = section<char>(off, head_->charText_);
+        wordKeys_ = section<uint64_t>(off, head_->words_);
+        wordDisp_ = section<uint32_t>(off, head_->wordBuckets_);
+        wordOffs_ = section<int>(off, head_->words_+1);
+        wordText_ = section<int>(off, head_->wordText_);
+        parents_ = section<int>(off, head_->nodes_);
+        contexts_ = section<int>(off, head_->nodes_);
+        fallbacks_ = section<double>(off, head_->nodes_);
+        entryKeys_ = section<uint64_t>(off, head_->entries_);
+        entryDisp_ = section<uint32_t>(off, head_->entryBuckets_);
+        entryProbs_ = section<double>(off, head_->entries_);
+        entryChildren_ = section<int>(off, head_->entries_);
+        if(off > size_) {
+            unload();
+            THROW_ERROR("frozen model file " << fileName << " is truncated");
+        }
+    }
+
+    // the ID of a character, or -1 if it is unknown
+    int getCharId(const string & str) const {
+        int s = findKey(hashString(str.c_str(), str.length()), charKeys_, charDisp_, head_->charBuckets_, head_->chars_);
+        if(s < 0 || charOffs_[s+1]-charOffs_[s] != (int)str.length() || memcmp(charText_+charOffs_[s], str.c_str(), str.length()) != 0)
+            return -1;
+        return s;
+    }
+    string getCharString(int cid) const { return string(charText_+charOffs_[cid], charOffs_[cid+1]-charOffs_[cid]); }
+
+    // the ID of a word of len characters, or -1 if it is unknown
+    int getWordId(const int* chars, int len) const {
+        int s = findKey(hashWord(chars, len), wordKeys_, wordDisp_, head_->wordBuckets_, head_->words_);
+        if(s < 0 || wordOffs_[s+1]-wordOffs_[s] != len || memcmp(wordText_+wordOffs_[s], chars, len*sizeof(int)) != 0)
+            return -1;
+        return s;
+    }
+    int getWordLength(int wid) const { return wordOffs_[wid+1]-wordOffs_[wid]; }
+
+    // the base probability of an unknown word with len characters
+    double getBase(int len) const { return bases_[len]; }
+
+    // the probability of a word with len characters in the context of node,
+    //  where wid is -1 if the word is unknown
+    double getProb(int node, int wid, int len) const {
+        double mult = 1;
+        while(true) {
+            if(wid >= 0) {
+                int s = findKey(entryKey(node, wid), entryKeys_, entryDisp_, head_->entryBuckets_, head_->entries_);
+                if(s >= 0 && entryProbs_[s] >= 0)
+                    return mult*entryProbs_[s];
+            }
+            mult *= fallbacks_[node];
+            if(node == 0) break;
+            node = parents_[node];
+        }
+        return mult*bases_[len];
+    }
+
+    // the child of node for wid, or -1 if there is none
+    int getChild(int node, int wid) const {
+        int s = findKey(entryKey(node, wid), entryKeys_, entryDisp_, head_->entryBuckets_, head_->entries_);
+        return s >= 0 ? entryChildren_[s] : -1;
+    }
+
+    // the longest context that exists after wid follows the context of node
+    int getNext(int node, int wid) const {
+        if(wid < 0) return 0;
+        gng::SmallVector<int,8> context;
+        for( ; node != 0; node = parents_[node])
+            context.push_back(contexts_[node]);
+        context.push_back(wid);
+        int len = min((int)context.size(), head_->n_-1);
+        for(int lev = 0; lev < len; lev++) {
+            int next = getChild(node, context[context.size()-1-lev]);
+            if(next < 0) return node;
+            node = next;
+        }
+        return node;
+    }
+
+    int getN() const { return head_->n_; }
+    int getMaxLen() const { return head_->maxLen_; }
+    int getInitId() const { return head_->initId_; }
+    int getInitNode() const { return head_->initNode_; }
+    int getCharCount() const { return head_->chars_; }
+    int getWordCount() const { return head_->words_; }
+    int getNodeCount() const { return head_->nodes_; }
+    int getEntryCount() const { return head_->entries_; }
+    size_t getFileSize() const { return size_; }
+
+};
+
+}
+
+#endif
@@ -10,15 +10,14 @@
 
 #include "pgibbs/labels-base.h"
 #include "pgibbs/corpus-word.h"
+#include "pgibbs/bounds-ws.h"
+#include "pgibbs/constraints-ws.h"
 #include "gng/samp-gen.h"
 
 using namespace std;
 
 namespace pgibbs {
 
-// hold the classes as an integer vector
-typedef vector<bool> Bounds;
-
 class WSLabels : public LabelsBase<WordSent,Bounds> {
 
 public:
@@ -29,15 +28,41 @@ public:
 
     // 0->classes-1 are normal tags, classes is the final tag
     void initRandom(const CorpusBase<WordSent> & corp, const ConfigBase & conf) {
+        initRandom(corp, conf, 0);
+    }
+
+    // initialize randomly, keeping the known boundaries of each sentence
+    void initRandom(const CorpusBase<WordSent> & corp, const ConfigBase & conf, const WSConstraints * cons) {
         int maxLen = conf.getInt("maxlen");
         cerr << "maxLen = "<<maxLen<<endl;
         int i, j, cs = corp.size();
+        vector<int> nextFree;
         for(i = 0; i < cs; i++) {
             const WordSent & chars = corp[i];
             Bounds bs(chars.length());
+            const char* flags = (cons ? cons->getFlags(i) : 0);
+            if(flags) {
+                // split where the next possible boundary would be too far
+                int len = chars.length(), last = -1;
+                nextFree.resize(len+1);
+                nextFree[len] = len;
+                for(j = len-1; j >= 0; j--)
+                    nextFree[j] = (flags[j] != WSConstraints::JOIN ? j : nextFree[j+1]);
+                for(j = 0; j < len; j++) {
+                    if(j == len-1 || flags[j] == WSConstraints::SPLIT)
+                        bs.set(j, 1);
+                    else if(flags[j] == WSConstraints::JOIN)
+                        bs.set(j, 0);
+                    else
+                        bs.set(j, nextFree[j+1]-last > maxLen || bernoulliSample(0.5));
+                    if(bs[j]) last = j;
+                }
+                push_back(bs);
+                continue;
+            }
             int last = 0;
             for(j = 0; j < (int)chars.length(); j++) {
-                bs[j] = (j==(int)chars.length()-1 || j-last==maxLen-1)?1:bernoulliSample(0.5);
+                bs.set(j, (j==(int)chars.length()-1 || j-last==maxLen-1)?1:bernoulliSample(0.5));
                 if(bs[j]) last = j;
             }
             push_back(bs);
@@ -47,12 +72,14 @@ public:
     void print(const CorpusBase<WordSent> & corp, ostream & out) {
         int cs = size(), i, j;
         for(i = 0; i < cs; i++) {
-            if (corp[i].length() > 0) {
-                out << corp.getSymbol(corp[i][0]);
-                for(j = 1; j < (int)(*this)[i].size(); j++) {
-                    if((*this)[i][j-1]) out << " ";
+            // print a word at a time, up to each set bit
+            const Bounds & bs = (*this)[i];
+            int len = min((int)corp[i].length(), bs.size());
+            for(int beg = 0, end; beg < len; beg = end+1) {
+                end = min(bs.next(beg), len-1);
+                if(beg) out << " ";
+                for(j = beg; j <= end; j++)
                     out << corp.getSymbol(corp[i][j]);
-                }
             }
             out << endl;
         }
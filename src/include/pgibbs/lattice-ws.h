@@ -0,0 +1,206 @@
+#ifndef LATTICE_WS_H__
+#define LATTICE_WS_H__
+
+#include "pgibbs/definitions.h"
+#include <atomic>
+#include <vector>
+
+namespace pgibbs {
+
+// a segmentation lattice stored in flat arrays. the states at each position
+//  are found through an open-addressed table keyed by LM node, and the
+//  back-links of each state are stored contiguously (CSR-style) in a single
+//  link array. clearing keeps all memory, so one lattice can be reused for
+//  every sentence without allocating
+class WSLattice {
+
+public:
+
+    struct State {
+        int node_;              // the language model state
+        int pos_;               // the position in the sentence
+        int linkBeg_, linkEnd_; // the range of back-links in the link arrays
+        double prob_;           // the log probability of reaching this state
+    };
+
+protected:
+
+    std::vector<State> states_;
+    std::vector<int> posBeg_;        // first state of each position
+    std::vector<int> hashBeg_;       // first slot of each position's table
+    std::vector<int> slots_;         // state indices, or -1 for empty
+    std::vector<int> linkState_;     // the previous state of each link
+    std::vector<double> linkProb_;   // the log probability of each link
+
+    // links for the open position, before they are grouped by state
+    std::vector<int> pendTo_, pendFrom_, counts_;
+    std::vector<double> pendProb_;
+
+    bool viterbi_;
+
+    static unsigned hashSlot(int node, unsigned mask) {
+        unsigned h = (unsigned)node*2654435761u;
+        return (h ^ (h >> 16)) & mask;
+    }
+
+    // re-insert the states of the open position into a table of size cap
+    void rehash(int cap) {
+        int hb = hashBeg_.back();
+        slots_.resize(hb);
+        slots_.resize(hb+cap, -1);
+        for(int i = posBeg_.back(); i < (int)states_.size(); i++) {
+            unsigned s = hashSlot(states_[i].node_, cap-1);
+            while(slots_[hb+s] != -1)
+                s = (s+1) & (cap-1);
+            slots_[hb+s] = i;
+        }
+    }
+
+    // find the state for node in the open position, adding it if necessary
+    int findOrAdd(int node) {
+        int hb = hashBeg_.back(), cap = slots_.size()-hb;
+        unsigned s = hashSlot(node, cap-1);
+        for( ; slots_[hb+s] != -1; s = (s+1) & (cap-1))
+            if(states_[slots_[hb+s]].node_ == node)
+                return slots_[hb+s];
+        State st = { node, (int)posBeg_.size()-1, 0, 0, NEG_INFINITY };
+        int ret = states_.size();
+        states_.push_back(st);
+        if((ret-posBeg_.back()+1)*2 > cap)
+            rehash(cap*2);
+        else
+            slots_[hb+s] = ret;
+        return ret;
+    }
+
+public:
+
+    WSLattice() : viterbi_(false) { }
+
+    // keep the probability of the best link into each state instead of
+    //  their sum, so each state holds the score of its best path
+    void setViterbi(bool viterbi) { viterbi_ = viterbi; }
+    bool isViterbi() const { return viterbi_; }
+
+    // clear the lattice and start it with a single state at position 0
+    void start(int node) {
+        states_.clear(); posBeg_.clear(); hashBeg_.clear(); slots_.clear();
+        linkState_.clear(); linkProb_.clear();
+        posBeg_.push_back(0);
+        openPosition();
+        states_[findOrAdd(node)].prob_ = 0.0;
+        closePosition();
+    }
+
+    // start adding states to the next position
+    void openPosition() {
+        int cap = 8, prev = posBeg_.size() > 1 ? posBeg_.back()-posBeg_[posBeg_.size()-2] : 0;
+        while(cap < prev*2) cap *= 2;
+        hashBeg_.push_back(slots_.size());
+        slots_.resize(slots_.size()+cap, -1);
+    }
+
+    // add a link into the state for node in the open position
+    void addLink(int node, int prevState, double logProb) {
+        pendTo_.push_back(findOrAdd(node));
+        pendFrom_.push_back(prevState);
+        pendProb_.push_back(logProb);
+    }
+
+    // group the links of the open position by state and sum (or maximize)
+    //  their probabilities
+    void closePosition() {
+        int first = posBeg_.back(), n = states_.size()-first, base = linkState_.size();
+        counts_.assign(n+1, 0);
+        for(int i = 0; i < (int)pendTo_.size(); i++)
+            counts_[pendTo_[i]-first+1]++;
+        for(int i = 0; i < n; i++) {
+            counts_[i+1] += counts_[i];
+            states_[first+i].linkBeg_ = base+counts_[i];
+            states_[first+i].linkEnd_ = base+counts_[i+1];
+        }
+        linkState_.resize(base+pendTo_.size());
+        linkProb_.resize(base+pendTo_.size());
+        for(int i = 0; i < (int)pendTo_.size(); i++) {
+            int pos = base+counts_[pendTo_[i]-first]++;
+            linkState_[pos] = pendFrom_[i];
+            linkProb_[pos] = pendProb_[i];
+        }
+        for(int i = first; i < (int)states_.size(); i++) {
+            State & st = states_[i];
+            if(st.linkBeg_ == st.linkEnd_) continue;
+            double myMax = NEG_INFINITY, norm = 0;
+            for(int j = st.linkBeg_; j < st.linkEnd_; j++)
+                myMax = std::max(myMax, linkProb_[j]);
+            if(viterbi_) {
+                st.prob_ = myMax;
+                continue;
+            }
+            for(int j = st.linkBeg_; j < st.linkEnd_; j++)
+                norm += exp(linkProb_[j]-myMax);
+            st.prob_ = log(norm)+myMax;
+        }
+        pendTo_.clear(); pendFrom_.clear(); pendProb_.clear();
+        posBeg_.push_back(states_.size());
+    }
+
+    // find the state for node at a closed position, or -1 if it doesn't exist
+    int findState(int pos, int node) const {
+        int hb = hashBeg_[pos];
+        unsigned mask = (pos+1 < (int)hashBeg_.size() ? hashBeg_[pos+1] : slots_.size())-hb-1;
+        for(unsigned s = hashSlot(node, mask); slots_[hb+s] != -1; s = (s+1) & mask)
+            if(states_[slots_[hb+s]].node_ == node)
+                return slots_[hb+s];
+        return -1;
+    }
+
+    int getPositionCount() const { return posBeg_.size()-1; }
+    int getPosBegin(int pos) const { return posBeg_[pos]; }
+    int getPosEnd(int pos) const { return posBeg_[pos+1]; }
+    int getStateCount() const { return states_.size(); }
+    int getLinkCount() const { return linkState_.size(); }
+    const State & getState(int i) const { return states_[i]; }
+    int getLinkState(int i) const { return linkState_[i]; }
+    double getLinkProb(int i) const { return linkProb_[i]; }
+
+    // the number of bytes reserved by the lattice
+    size_t getMemoryUsage() const {
+        return states_.capacity()*sizeof(State) +
+            (posBeg_.capacity()+hashBeg_.capacity()+slots_.capacity()+linkState_.capacity()+
+             pendTo_.capacity()+pendFrom_.capacity()+counts_.capacity())*sizeof(int) +
+            (linkProb_.capacity()+pendProb_.capacity())*sizeof(double);
+    }
+
+};
+
+// the total size of the lattices, the time taken to sample them, and the
+//  largest memory used by one lattice, added to by every sampling thread and
+//  reset each time it is reported
+class WSLatticeStats {
+
+protected:
+
+    std::atomic<long long> states_, positions_, micros_;
+    std::atomic<size_t> maxMemory_;
+
+public:
+
+    WSLatticeStats() { reset(); }
+    WSLatticeStats(const WSLatticeStats &) { reset(); }
+
+    void add(int states, int positions, long long micros, size_t memory) {
+        states_ += states; positions_ += positions; micros_ += micros;
+        size_t old = maxMemory_;
+        while(old < memory && !maxMemory_.compare_exchange_weak(old, memory));
+    }
+    void reset() { states_ = 0; positions_ = 0; micros_ = 0; maxMemory_ = 0; }
+
+    double getStatesPerPosition() const { return (double)states_/std::max((long long)positions_,1LL); }
+    double getMicrosPerPosition() const { return (double)micros_/std::max((long long)positions_,1LL); }
+    size_t getMaxMemory() const { return maxMemory_; }
+
+};
+
+}
+
+#endif
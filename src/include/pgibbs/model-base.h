@@ -15,17 +15,18 @@ protected:
     ConfigBase conf_;
 
     // saved variables used in every model
-    int iters_, accepted_, sents_, numThreads_, blockSize_, skipIters_, verbose_;
+    int iters_, accepted_, sents_, numThreads_, blockSize_, skipIters_, verbose_, sentIters_;
     bool doShuffle_, printModel_, printStatus_, sampParam_;
     string prefix_;
     vector<int> sentOrder_, sentAccepted_;
     vector<bool> sentInc_;
     double likelihood_, iterTime_; 
+    long long iterMisses_; // hardware cache misses, or -1 if not counted
 
 public:
 
     ModelBase(const ConfigBase & conf) : iters_(0), accepted_(0), sents_(0),
-        numThreads_(1), blockSize_(1), skipIters_(0) {
+        numThreads_(1), blockSize_(1), skipIters_(0), sentIters_(0), iterMisses_(-1) {
         conf_ = conf;
     }
 
@@ -42,6 +43,11 @@ public:
     void trainInBlocks(CorpusBase<Sent> & corp, LabelsBase<Sent,Labs> & labs);
     // train in blocks, but using single acceptance/rejection
     void trainInBlocksSingle(CorpusBase<Sent> & corp, LabelsBase<Sent,Labs> & labs);
+    // train with all threads sampling from and updating one shared model
+    void trainInAsync(CorpusBase<Sent> & corp, LabelsBase<Sent,Labs> & labs);
+    // train by resampling one label at a time, with a sentence-wise pass
+    //  every sentIters_ iterations
+    void trainInPoints(CorpusBase<Sent> & corp, LabelsBase<Sent,Labs> & labs);
 
     // function to clear the model (remove all sentences and check if empty)
     void clear(CorpusBase<Sent> & corp, LabelsBase<Sent,Labs> & labs);
@@ -58,10 +64,21 @@ public:
             this->trainInBlocks(sent,labs);
         else if (sampMeth == "single")
             this->trainInBlocksSingle(sent,labs);
+        else if (sampMeth == "async")
+            this->trainInAsync(sent,labs);
+        else if (sampMeth == "point")
+            this->trainInPoints(sent,labs);
         else
             THROW_ERROR("Illegal -sampmeth argument '"<<sampMeth<<"'"<<endl);
     }
 
+    // the random stream of the calling thread for rand_r, or 0 to draw from
+    //  rand(). asynchronous training gives each worker its own stream
+    static unsigned *& threadSeed() {
+        static thread_local unsigned * seed = 0;
+        return seed;
+    }
+
     // -------------------- getters/setters -----------------------------
 
     int getVerbose() const { return verbose_; }
@@ -74,6 +91,12 @@ public:
     // processing sentences
     virtual double addSentence(int sid, const Sent & sent, const Labs & labs) = 0;
     virtual double removeSentence(int sid, const Sent & sent, const Labs & labs) = 0;
+    // change the labels of a sentence in the model, for example back to the
+    //  old labels after a rejected sample
+    virtual void replaceSentence(int sid, const Sent & sent, const Labs & oldLabs, const Labs & newLabs) {
+        removeSentence(sid,sent,oldLabs);
+        addSentence(sid,sent,newLabs);
+    }
 
     // sampling functions
     // must be called between any changes to the model and sampling
@@ -82,9 +105,23 @@ public:
     //  return is the proposal probability of the old and new labels
     virtual pair<double,double> sampleSentence(int sid, const Sent & sent, Labs & oldLabs, Labs & newLabs) const = 0;
 
+    // resample each label of a sentence that is in the model in turn,
+    //  leaving it in the model. changed is set if any label changed, and
+    //  the return is the change in the log probability of the sentence
+    virtual double samplePointwise(int, const Sent &, Labs &, bool &) {
+        THROW_ERROR("This model does not support pointwise sampling (-sampmeth point)");
+    }
+
     // sample the parameters
     virtual void sampleParameters() = 0;
 
+    // allow (or stop allowing) addSentence, removeSentence and sampleSentence
+    //  to be called by several threads at once, for asynchronous sampling
+    virtual void setConcurrent(bool conc) {
+        if(conc)
+            THROW_ERROR("This model does not support asynchronous sampling (-sampmeth async)");
+    }
+
     // check to make sure that everything has been removed properly
     virtual void checkEmpty() const = 0;
 
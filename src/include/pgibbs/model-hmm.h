@@ -5,9 +5,34 @@
 #include "pgibbs/config-hmm.h"
 #include "pgibbs/labels-hmm.h"
 #include "pgibbs/dist-py.h"
+#include "gng/lock-stripes.h"
+#include <atomic>
+#include <memory>
 
 namespace pgibbs {
 
+// one thread's copy of the log emission probabilities of each word it has
+//  sampled, by class. a word's copy is only used in the refresh period
+//  and asynchronous pass (serial) it was made in
+class HMMEmitCache {
+
+public:
+    unsigned serial_;
+    vector<int> periods_; // the period each word was copied in, or -1
+    vector< vector<double> > emits_;
+
+    HMMEmitCache() : serial_(0) { }
+
+    // start using the cache for the pass with the given serial
+    void bind(unsigned serial, int words) {
+        if(serial == serial_) return;
+        serial_ = serial;
+        periods_.assign(words, -1);
+        emits_.resize(words);
+    }
+
+};
+
 class HMMModel : public ModelBase<WordSent,ClassSent> {
 
 protected:
@@ -19,8 +44,8 @@ protected:
     string base_;
 
     // distributions
-	vector< PyDist<PyDenseIndex>* > tDists_;
-	vector< PyDist<PySparseIndex>* > eDists_;
+	vector< PyDist<PyDenseIndex,PyHistTableSet>* > tDists_;
+	vector< PyDist<PyAdaptiveIndex,PyHistTableSet>* > eDists_;
 
     // cache of the transition probabilities
     vector<double> tMat_;
@@ -30,18 +55,75 @@ protected:
     double tStrA_, tStrB_, tDiscA_, tDiscB_;
     double eStrA_, eStrB_, eDiscA_, eDiscB_;    
 
+    // for asynchronous sampling, locks on each distribution, and a shared
+    //  copy of the transition probabilities that is replaced every refresh_
+    //  sentences. the copy can be out of date, so the difference between
+    //  the old and new values is recorded when it is replaced. emissions
+    //  are copied by each thread as it needs them, and the copies are
+    //  dropped at the same refreshes. every pass gets a new serial
+    bool async_;
+    int refresh_;
+    unsigned serial_;
+    mutable gng::LockStripes<64> tLocks_, eLocks_;
+    gng::LockStripes<1> statLock_;
+    std::shared_ptr< const vector<double> > tShared_;
+    std::atomic<int> sinceRefresh_;
+    int refreshes_;
+    double driftSum_, driftMax_;
+
+    // get the transition probabilities from the distributions
+    void makeTransitions(vector<double> & tMat) const;
+
+    // change the distributions holding their locks
+    double addTrans(int prev, int tag) {
+        tLocks_.lock(prev);
+        double ret = tDists_[prev]->add(tag,baseT_[tag],threadSeed());
+        tLocks_.unlock(prev);
+        return ret;
+    }
+    double removeTrans(int prev, int tag) {
+        tLocks_.lock(prev);
+        double ret = tDists_[prev]->remove(tag,baseT_[tag],threadSeed());
+        tLocks_.unlock(prev);
+        return ret;
+    }
+    double addEmit(int tag, int word) {
+        eLocks_.lock(tag);
+        double ret = eDists_[tag]->add(word,baseE_[word],threadSeed());
+        eLocks_.unlock(tag);
+        return ret;
+    }
+    double removeEmit(int tag, int word) {
+        eLocks_.lock(tag);
+        double ret = eDists_[tag]->remove(word,baseE_[word],threadSeed());
+        eLocks_.unlock(tag);
+        return ret;
+    }
+    double getEmit(int tag, int word) const {
+        return eDists_[tag]->getProb(word,baseE_[word]);
+    }
+    // the log emission probabilities of word for each class, from the
+    //  thread's copy made in the current refresh period
+    const double* getLogEmits(int word, HMMEmitCache & cache, int period) const;
+
+    static unsigned nextSerial() {
+        static std::atomic<unsigned> serial(0);
+        return ++serial;
+    }
+
 public:
     HMMModel(const HMMModel & mod) : ModelBase<WordSent,ClassSent>(mod),
     classes_(mod.classes_), words_(mod.words_), base_(mod.base_), tMat_(mod.tMat_), 
     baseE_(mod.baseE_), baseT_(mod.baseT_), 
     tStrA_(mod.tStrA_), tStrB_(mod.tStrB_), tDiscA_(mod.tDiscA_), tDiscB_(mod.tDiscB_), 
-    eStrA_(mod.eStrA_), eStrB_(mod.eStrB_), eDiscA_(mod.eDiscA_), eDiscB_(mod.eDiscB_)
+    eStrA_(mod.eStrA_), eStrB_(mod.eStrB_), eDiscA_(mod.eDiscA_), eDiscB_(mod.eDiscB_),
+    async_(false), refresh_(mod.refresh_), serial_(0), sinceRefresh_(0), refreshes_(0), driftSum_(0), driftMax_(0)
     {
-	    tDists_=vector< PyDist<PyDenseIndex>* >(mod.tDists_.size());
-	    eDists_=vector< PyDist<PySparseIndex>* >(mod.eDists_.size());
+	    tDists_=vector< PyDist<PyDenseIndex,PyHistTableSet>* >(mod.tDists_.size());
+	    eDists_=vector< PyDist<PyAdaptiveIndex,PyHistTableSet>* >(mod.eDists_.size());
         for(int i = 0; i < (int)tDists_.size(); i++) {
-            tDists_[i] = new PyDist<PyDenseIndex>(*mod.tDists_[i]);
-            eDists_[i] = new PyDist<PySparseIndex>(*mod.eDists_[i]);
+            tDists_[i] = new PyDist<PyDenseIndex,PyHistTableSet>(*mod.tDists_[i]);
+            eDists_[i] = new PyDist<PyAdaptiveIndex,PyHistTableSet>(*mod.eDists_[i]);
         }
     }
 
@@ -52,7 +134,9 @@ public:
         tStrA_(conf.getDouble("tstra")), tStrB_(conf.getDouble("tstrb")),
         tDiscA_(conf.getDouble("tdisca")), tDiscB_(conf.getDouble("tdiscb")),
         eStrA_(conf.getDouble("estra")), eStrB_(conf.getDouble("estrb")),
-        eDiscA_(conf.getDouble("edisca")), eDiscB_(conf.getDouble("ediscb"))
+        eDiscA_(conf.getDouble("edisca")), eDiscB_(conf.getDouble("ediscb")),
+        async_(false), refresh_(conf.getInt("refresh")), serial_(0), sinceRefresh_(0),
+        refreshes_(0), driftSum_(0), driftMax_(0)
     {
 #ifdef DEBUG_ON
         if(words_ == 0)
@@ -61,11 +145,11 @@ public:
             THROW_ERROR("No classes in HMM Model");
         cout << "Words == "<<words_<<" Classes == "<<classes_<<endl;
 #endif
-        tDists_ = vector< PyDist<PyDenseIndex>* >(classes_+1);
-        eDists_ = vector< PyDist<PySparseIndex>* >(classes_+1);
+        tDists_ = vector< PyDist<PyDenseIndex,PyHistTableSet>* >(classes_+1);
+        eDists_ = vector< PyDist<PyAdaptiveIndex,PyHistTableSet>* >(classes_+1);
         for(int i = 0; i <= classes_; i++) {
-            tDists_[i] = new PyDist<PyDenseIndex>(conf.getDouble("tstr"), conf.getDouble("tdisc"));
-            eDists_[i] = new PyDist<PySparseIndex>(conf.getDouble("estr"), conf.getDouble("edisc"));
+            tDists_[i] = new PyDist<PyDenseIndex,PyHistTableSet>(conf.getDouble("tstr"), conf.getDouble("tdisc"));
+            eDists_[i] = new PyDist<PyAdaptiveIndex,PyHistTableSet>(conf.getDouble("estr"), conf.getDouble("edisc"));
         }
     }
 
@@ -84,12 +168,20 @@ public:
     double removeSentence(int sid, const WordSent & sent, const ClassSent & labs);
 
     // virtual function for processing sentences
-    double backwardStep(const vector<double> & forProbs, ClassSent & tags, bool sample) const;
+    double backwardStep(const vector<double> & tMat, const vector<double> & forProbs, ClassSent & tags, bool sample) const;
 
     // virtual functions for processing sentences
     void cacheProbabilities();
     pair<double,double> sampleSentence(int sid, const WordSent & sent, ClassSent & oldLabs, ClassSent & newLabs) const;
 
+    void setConcurrent(bool conc);
+
+    // the refreshes of the shared transition matrix in the last
+    //  asynchronous pass, and the sum and maximum of their drift
+    int getRefreshes() const { return refreshes_; }
+    double getDriftSum() const { return driftSum_; }
+    double getDriftMax() const { return driftMax_; }
+
     void checkEmpty() const {
         for(int i = 0; i < (int)tDists_.size(); i++)
             if(!tDists_[i]->isEmpty())
@@ -6,31 +6,19 @@
 #include "pgibbs/labels-ws.h"
 #include "pgibbs/dist-py.h"
 #include "pgibbs/dist-pylm.h"
+#include "pgibbs/lattice-ws.h"
+#include "pgibbs/vocab-ws.h"
+#include "pgibbs/frozen-ws.h"
 #include <map>
+#include <algorithm>
 
 using namespace std;
 
 namespace pgibbs {
 
-class SegHyp {
-
-public:
-
-    int node_;                      // pointer to the language model state
-    double prob_;                   // the probability of this node
-    vector< pair<int,int> > links_; // back-links to previous node
-    vector< double > linkProbs_;    // probabilities of each link
-
-    SegHyp (int node) : node_(node), prob_(NEG_INFINITY) { }
-
-};
-
 class WSModel : public ModelBase<WordSent,Bounds> {
 
 protected:
-    // stack of hypotheses
-    typedef map<int,SegHyp> Stack;
-    
     // a Pitman-Yor language model for words
     PYLM lm_;
 
@@ -43,24 +31,75 @@ protected:
     // initial values
     GenericString<int> initString_;
     int initNode_, initId_;
-    
-    typedef SymbolSet< GenericString<int>, int, GenericStringHash<int> > Symbols;
-    Symbols symbols_; 
+
+    // the vocabulary of words, and a trie over their characters
+    WSVocab symbols_; 
+
+    // candidate word IDs of each sentence, filled in while sampling
+    mutable WSCandidateCache cands_;
+
+    // LM probabilities shared by the sampling threads while the LM is fixed
+    mutable PYLMMemo memo_;
 
     double str_,disc_,strA_,strB_,discA_,discB_;
 
+    // whether to compact the LM nodes when sampling parameters
+    bool compact_;
+
+    // whether several threads are sampling and updating the model at once
+    bool async_;
+
+    // whether the threads sampling a block share the memo. the other
+    //  methods change the LM after every sentence, so it would rarely hit
+    bool blockMemo_;
+
+    // the exponent of the slice variables, or 0 to sample the full lattice
+    double slice_;
+
+    // the spacing of the windows that long sentences are sampled in, which
+    //  overlap by maxLen_ characters, or 0
+    int chunk_;
+
+    // known boundaries of the sentences, or 0 if there are none
+    const WSConstraints * cons_;
+
+    // lattice sizes and sampling times, reported with the parameters
+    mutable WSLatticeStats latStats_;
+
+    // get the log probability of a segmentation, and if slice is given,
+    //  draw a slice variable at each position. if path is given, save the
+    //  LM state and word end at the start of each word
+    double walkPath(const int* wids, const Bounds & bounds, PYLMNextCache * cache, vector<double> * slice, vector< pair<int,int> > * path) const;
+
+    // add words [beg,end) of a sentence in order, or remove them in reverse,
+    //  and return the sum of their log probabilities
+    double changeWords(const vector<int> & words, int beg, int end, bool add);
+
+    // get the ID of a word in a sentence, adding it to the vocabulary
+    int getWordId(const WordSent & sent, const int* wids, int beg, int end);
+    void setBoundary(const WordSent & sent, const int* wids, vector<int> & words, vector<int> & ends, int k, int beg, int mid, int end, bool split);
+
 public:
     WSModel(const WSConfig & conf) : ModelBase<WordSent,Bounds>(conf), 
         chars_(conf.getInt("chars")), n_(conf.getInt("n")), 
         maxLen_(conf.getInt("maxlen")),
         str_(conf.getDouble("str")), disc_(conf.getDouble("disc")),
         strA_(conf.getDouble("stra")), strB_(conf.getDouble("strb")),
-        discA_(conf.getDouble("disca")), discB_(conf.getDouble("discb"))
+        discA_(conf.getDouble("disca")), discB_(conf.getDouble("discb")),
+        compact_(conf.getBool("compact")), async_(false),
+        blockMemo_(conf.getString("sampmeth") == "block" || conf.getString("sampmeth") == "single"),
+        slice_(conf.getDouble("slice")), chunk_(conf.getInt("chunk")), cons_(0)
     {
 #ifdef DEBUG_ON
         if(chars_ == 0)
             THROW_ERROR("No chars in WS Model");
 #endif
+        if(slice_ < 0 || slice_ > 1)
+            THROW_ERROR("-slice must be between 0 and 1, but is "<<slice_);
+        if(chunk_ < 0)
+            THROW_ERROR("-chunk must not be negative, but is "<<chunk_);
+        if(chunk_ > 0 && slice_ > 0)
+            THROW_ERROR("-chunk can't be used with -slice");
         lm_.setN(n_);
         for(int i = 0; i < n_; i++) {
             lm_.setStrength(i,str_);
@@ -83,18 +122,33 @@ public:
     // virtual functions for processing sentences
     double addSentence(int sid, const WordSent & sent, const Bounds & labs);
     double removeSentence(int sid, const WordSent & sent, const Bounds & labs);
+    void replaceSentence(int sid, const WordSent & sent, const Bounds & oldLabs, const Bounds & newLabs);
 
-    double backwardStep(const WordSent & chars, const vector<Stack> & stacks, Bounds & bounds, bool sample) const;
+    void buildLattice(WSLattice & lattice, int sid, const int* wids, int beg, int end, int noBeg, int noEnd, const vector< pair<int,double> > & after, int node, const vector<double> * slice, const vector< pair<int,int> > * oldPath, PYLMNextCache * cache) const;
+    double backwardStep(const int* wids, const WSLattice & lattice, Bounds & bounds, int beg, int node, bool sample) const;
 
     // virtual functions for processing sentences
-    void cacheProbabilities() { };
+    void cacheProbabilities() { if(blockMemo_ && numThreads_ > 1 && !async_) memo_.activate(true); };
     pair<double,double> sampleSentence(int sid, const WordSent & sent, Bounds & oldLabs, Bounds & newLabs) const;
 
+    double samplePointwise(int sid, const WordSent & sent, Bounds & bounds, bool & changed);
+
     void initialize(CorpusBase<WordSent> & corp, LabelsBase<WordSent,Bounds> & labs, bool add);
 
+    // set the known boundaries, which must outlive the model
+    void setConstraints(const WSConstraints * cons) { cons_ = cons; }
+
+    // write a read-only copy of the LM and vocabulary, which can be mapped
+    //  by WSFrozenModel, using the characters of corp
+    void freeze(const CorpusBase<WordSent> & corp, const string & fileName) const;
+
+    const PYLM & getLM() const { return lm_; }
+    const WSVocab & getVocab() const { return symbols_; }
+    int getInitNode() const { return initNode_; }
+
     double getBase(const GenericString<int> & str) const;
     double getBase(int wid) const;
-    WordSent makeWords(const WordSent & sent, const Bounds & bounds, bool add);
+    void makeWords(const WordSent & sent, const Bounds & bounds, bool add, vector<int> & words);
 
     void checkEmpty() const {
         if(!lm_.isEmpty())
@@ -105,22 +159,56 @@ public:
         THROW_ERROR("WSModel::print not implemented yet");
     }
 
+    // the LM and vocabulary lock themselves, and the memo is not used
+    void setConcurrent(bool conc) {
+        async_ = conc;
+        lm_.setConcurrent(conc);
+        symbols_.setConcurrent(conc);
+        memo_.clear();
+    }
+
     ModelBase<WordSent,Bounds> * clone() const { 
         return new WSModel(*this);
     }
 
     void sampleParameters() {
-        Symbols::Map & map = symbols_.getMap();
+        // free the words with no customers. only words that lost their last
+        //  customer since the last iteration can be free, and no sampler is
+        //  running between iterations to see a freed ID be reused
         vector<int> toRemove;
-        for(Symbols::Map::iterator it = map.begin(); it != map.end(); it++)
-            if(lm_.getCustCount(0,it->second) == 0)
-                toRemove.push_back(it->second);
-        for(int i = 0; i < (int)toRemove.size(); i++)
-            symbols_.removeId(toRemove[i]);
-        lm_.sampleParameters(strA_,strB_,discA_,discB_);
+        lm_.takeEmptiedWords(toRemove);
+        sort(toRemove.begin(), toRemove.end());
+        toRemove.erase(unique(toRemove.begin(), toRemove.end()), toRemove.end());
+        int freed = 0;
+        for(int i = 0; i < (int)toRemove.size(); i++) {
+            if(lm_.getCustCount(0,toRemove[i]) == 0) {
+                symbols_.removeId(toRemove[i]);
+                freed++;
+            }
+        }
+        memo_.clear();
+        int oldSize = lm_.getArraySize();
+        if(compact_) {
+            vector<int> refs(1, initNode_);
+            lm_.compact(refs);
+            initNode_ = refs[0];
+        }
+        lm_.sampleParameters(strA_,strB_,discA_,discB_,numThreads_);
         for(int i = 0; i < n_; i++)
             cerr << " v("<<i+1<<")="<<lm_.getLevelSize(i)<<", s("<<i+1<<")="<<lm_.getStrength(i)<<", d("<<i+1<<")="<<lm_.getDisc(i)<<endl;
-        cerr << " lmarr=" << lm_.getArraySize() << ", vocabarr="<<symbols_.capacity()<<","<<symbols_.hashCapacity() <<endl;
+        if(verbose_ > 0) {
+            int entries;
+            size_t lmMem = lm_.getMemoryUsage(entries);
+            pair<long long,long long> hits = memo_.getHitCounts();
+            cerr << " lmarr=" << oldSize << "->" << lm_.getArraySize()
+                 << ", vocabarr="<<symbols_.capacity()<<","<<symbols_.hashCapacity()<<", trienodes="<<symbols_.getTrieSize() <<", vocabfreed="<<freed<<"/"<<toRemove.size()
+                 << ", memohits=" << hits.first << "/" << hits.second << " ("<<100.0*hits.first/max(hits.second,1LL)<<"%)"
+                 << ", latstates=" << latStats_.getStatesPerPosition() << "/pos, lattime=" << latStats_.getMicrosPerPosition() << "us/char, latmem=" << latStats_.getMaxMemory()
+                 << ", candmem=" << cands_.getMemoryUsage() << ", candsents=" << cands_.getCachedCount()
+                 << ", lmmem=" << lmMem << ", lmentries=" << entries << " ("<<(double)lmMem/max(entries,1)<<" bytes/entry)" << endl;
+        }
+        memo_.resetHitCounts();
+        latStats_.reset();
     }
 
 };
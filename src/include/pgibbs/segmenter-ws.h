@@ -0,0 +1,281 @@
+#ifndef SEGMENTER_WS_H__
+#define SEGMENTER_WS_H__
+
+#include <deque>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <pthread.h>
+
+#include "pgibbs/definitions.h"
+#include "pgibbs/bounds-ws.h"
+#include "pgibbs/frozen-ws.h"
+#include "pgibbs/lattice-ws.h"
+#include "gng/samp-gen.h"
+
+using namespace std;
+
+namespace pgibbs {
+
+// segments new text with a frozen model, building the same lattice over LM
+//  states as WSModel::sampleSentence, and either taking the best path
+//  through it or sampling one. each thread needs its own segmenter, which
+//  keeps its lattice and buffers between sentences
+class WSSegmenter {
+
+protected:
+
+    const WSFrozenModel & model_;
+    bool sample_;
+    WSLattice lattice_;
+    vector<int> wids_, chars_;
+    vector<string> tokens_;
+    Bounds bounds_;
+    long long charCount_;
+
+public:
+
+    WSSegmenter(const WSFrozenModel & model, bool sample) : model_(model), sample_(sample), charCount_(0) {
+        lattice_.setViterbi(!sample);
+    }
+
+    // segment len characters with frozen IDs (-1 for unknown characters),
+    //  and return the log probability of the chosen segmentation
+    double segment(const int* chars, int len, Bounds & bounds, unsigned * seed) {
+        int maxLen = model_.getMaxLen();
+        // the frozen ID of each word, or -1 if it is unknown
+        wids_.assign(len*maxLen, -1);
+        for(int b = 0; b < len; b++)
+            for(int l = 1; l <= maxLen && b+l <= len && chars[b+l-1] >= 0; l++)
+                wids_[b*maxLen+l-1] = model_.getWordId(chars+b, l);
+        // build the lattice
+        lattice_.start(model_.getInitNode());
+        for(int e = 1; e <= len; e++) {
+            lattice_.openPosition();
+            for(int b = max(e-maxLen,0); b < e; b++) {
+                int wid = wids_[b*maxLen+e-b-1];
+                for(int s = lattice_.getPosBegin(b); s < lattice_.getPosEnd(b); s++) {
+                    int prevNode = lattice_.getState(s).node_;
+                    double myProb = log(model_.getProb(prevNode, wid, e-b));
+                    lattice_.addLink(model_.getNext(prevNode, wid), s, myProb + lattice_.getState(s).prob_);
+                }
+            }
+            lattice_.closePosition();
+        }
+        lattice_.openPosition();
+        for(int s = lattice_.getPosBegin(len); s < lattice_.getPosEnd(len); s++) {
+            double myProb = log(model_.getProb(lattice_.getState(s).node_, model_.getInitId(), 0));
+            lattice_.addLink(0, s, myProb + lattice_.getState(s).prob_);
+        }
+        lattice_.closePosition();
+        // walk back from the final state, taking the best link or sampling one
+        double logProb = 0;
+        int curr = lattice_.getPosBegin(len+1);
+        bounds = Bounds(len);
+        while(lattice_.getState(curr).linkBeg_ != lattice_.getState(curr).linkEnd_) {
+            const WSLattice::State & st = lattice_.getState(curr);
+            int nextLink = st.linkBeg_;
+            if(sample_) {
+                double left = uniformSample(seed);
+                for( ; nextLink+1 < st.linkEnd_ && (left -= exp(lattice_.getLinkProb(nextLink)-st.prob_)) > 0; nextLink++);
+            } else {
+                for(int j = st.linkBeg_+1; j < st.linkEnd_; j++)
+                    if(lattice_.getLinkProb(j) > lattice_.getLinkProb(nextLink))
+                        nextLink = j;
+            }
+            curr = lattice_.getLinkState(nextLink);
+            if(lattice_.getState(curr).pos_ != 0)
+                bounds.set(lattice_.getState(curr).pos_-1, 1);
+            logProb += lattice_.getLinkProb(nextLink)-lattice_.getState(curr).prob_;
+        }
+        charCount_ += len;
+        return logProb;
+    }
+
+    // segment a line of space-separated characters, and write the words
+    //  separated by spaces to out
+    double segmentLine(const string & line, string & out, unsigned * seed) {
+        istringstream iss(line);
+        int len = 0;
+        string tok;
+        while(iss >> tok) {
+            if((int)tokens_.size() <= len) tokens_.resize(len+1);
+            tokens_[len++].swap(tok);
+        }
+        chars_.resize(len);
+        for(int i = 0; i < len; i++)
+            chars_[i] = model_.getCharId(tokens_[i]);
+        double ret = segment(len ? &chars_[0] : 0, len, bounds_, seed);
+        out.clear();
+        for(int i = 0; i < len; i++) {
+            out += tokens_[i];
+            if(bounds_[i] && i != len-1)
+                out += ' ';
+        }
+        return ret;
+    }
+
+    long long getCharCount() const { return charCount_; }
+
+};
+
+// a batch of input lines and their segmentations
+struct WSSegmentBatch {
+    vector<string> lines_, outs_;
+    unsigned seed_;
+    bool done_;
+    WSSegmentBatch() : seed_(0), done_(false) { }
+};
+
+inline void* runWSSegmentWorker(void* ptr);
+
+// segments batches of lines on a pool of worker threads. the reading thread
+//  adds batches and writes them back in input order, stopping to wait when
+//  too many are unwritten so that memory stays bounded for any input size.
+//  each batch samples from its own seed, so the output does not depend on
+//  the number of threads
+class WSSegmentPool {
+
+protected:
+
+    const WSFrozenModel & model_;
+    bool sample_;
+    int maxPending_;
+    vector<pthread_t> threads_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t todoCond_, doneCond_;
+    deque<WSSegmentBatch*> todo_;  // batches waiting for a worker
+    deque<WSSegmentBatch*> order_; // unwritten batches in input order
+    bool finished_;
+    long long lineCount_, charCount_;
+
+    // write the finished batches at the front of the queue, waiting for
+    //  the first one while more than maxLeft batches are unwritten
+    void flush(ostream & out, int maxLeft) {
+        pthread_mutex_lock(&mutex_);
+        while(order_.size() > 0) {
+            WSSegmentBatch* batch = order_.front();
+            if(!batch->done_) {
+                if((int)order_.size() <= maxLeft) break;
+                pthread_cond_wait(&doneCond_, &mutex_);
+                continue;
+            }
+            order_.pop_front();
+            pthread_mutex_unlock(&mutex_);
+            for(int i = 0; i < (int)batch->outs_.size(); i++)
+                out << batch->outs_[i] << '\n';
+            delete batch;
+            pthread_mutex_lock(&mutex_);
+        }
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    void add(WSSegmentBatch* batch, ostream & out) {
+        flush(out, maxPending_-1);
+        batch->seed_ = randSample();
+        pthread_mutex_lock(&mutex_);
+        todo_.push_back(batch);
+        order_.push_back(batch);
+        pthread_cond_signal(&todoCond_);
+        pthread_mutex_unlock(&mutex_);
+    }
+
+    // the pool is not copied
+    WSSegmentPool(const WSSegmentPool & pool);
+    WSSegmentPool & operator=(const WSSegmentPool & pool);
+
+public:
+
+    WSSegmentPool(const WSFrozenModel & model, bool sample, int threads, int maxPending) :
+            model_(model), sample_(sample), maxPending_(max(maxPending,1)), threads_(max(threads,1)),
+            finished_(false), lineCount_(0), charCount_(0) {
+        pthread_mutex_init(&mutex_, NULL);
+        pthread_cond_init(&todoCond_, NULL);
+        pthread_cond_init(&doneCond_, NULL);
+        for(int i = 0; i < (int)threads_.size(); i++)
+            pthread_create(&threads_[i], NULL, runWSSegmentWorker, (void*) this);
+    }
+    ~WSSegmentPool() {
+        if(!finished_) {
+            ostringstream unused;
+            finish(unused);
+        }
+        pthread_cond_destroy(&doneCond_);
+        pthread_cond_destroy(&todoCond_);
+        pthread_mutex_destroy(&mutex_);
+    }
+
+    // the loop of each worker thread
+    void work() {
+        WSSegmenter seg(model_, sample_);
+        int lines = 0;
+        while(true) {
+            pthread_mutex_lock(&mutex_);
+            while(todo_.size() == 0 && !finished_)
+                pthread_cond_wait(&todoCond_, &mutex_);
+            if(todo_.size() == 0) {
+                lineCount_ += lines;
+                charCount_ += seg.getCharCount();
+                pthread_mutex_unlock(&mutex_);
+                return;
+            }
+            WSSegmentBatch* batch = todo_.front();
+            todo_.pop_front();
+            pthread_mutex_unlock(&mutex_);
+            batch->outs_.resize(batch->lines_.size());
+            for(int i = 0; i < (int)batch->lines_.size(); i++)
+                seg.segmentLine(batch->lines_[i], batch->outs_[i], &batch->seed_);
+            lines += batch->lines_.size();
+            pthread_mutex_lock(&mutex_);
+            batch->done_ = true;
+            pthread_cond_signal(&doneCond_);
+            pthread_mutex_unlock(&mutex_);
+        }
+    }
+
+    // segment every line of in in batches of batchSize, and write the
+    //  results to out as they finish
+    void segment(istream & in, ostream & out, int batchSize) {
+        if(finished_)
+            THROW_ERROR("WSSegmentPool::segment called after finish");
+        WSSegmentBatch* batch = new WSSegmentBatch;
+        string line;
+        while(getline(in, line)) {
+            batch->lines_.push_back(line);
+            if((int)batch->lines_.size() >= batchSize) {
+                add(batch, out);
+                batch = new WSSegmentBatch;
+            }
+        }
+        if(batch->lines_.size())
+            add(batch, out);
+        else
+            delete batch;
+    }
+
+    // write the remaining batches and stop the workers
+    void finish(ostream & out) {
+        pthread_mutex_lock(&mutex_);
+        finished_ = true;
+        pthread_cond_broadcast(&todoCond_);
+        pthread_mutex_unlock(&mutex_);
+        flush(out, 0);
+        for(int i = 0; i < (int)threads_.size(); i++)
+            pthread_join(threads_[i], NULL);
+        threads_.clear();
+    }
+
+    // the totals of the workers, available after finish
+    long long getLineCount() const { return lineCount_; }
+    long long getCharCount() const { return charCount_; }
+
+};
+
+inline void* runWSSegmentWorker(void* ptr) {
+    ((WSSegmentPool*)ptr)->work();
+    return NULL;
+}
+
+}
+
+#endif
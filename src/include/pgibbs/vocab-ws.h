@@ -0,0 +1,388 @@
+#ifndef VOCAB_WS_H__
+#define VOCAB_WS_H__
+
+#include "gng/string.h"
+#include "gng/symbol-set.h"
+#include "pgibbs/corpus-word.h"
+#include <unordered_map>
+#include <vector>
+#include <climits>
+#include <pthread.h>
+
+namespace pgibbs {
+
+// the word vocabulary for word segmentation, a symbol set that is mirrored
+//  in a character trie. the trie lets the lattice find the IDs of every
+//  known word starting at a position by walking forward one character at a
+//  time, instead of building and hashing every substring. single words are
+//  found through a hash of IDs that is probed with (offset,length) views of
+//  a sentence, so known words are found without building strings. when it
+//  is concurrent, lookups share a reader-writer lock and new words take it
+//  exclusively
+class WSVocab {
+
+public:
+
+    typedef gng::SymbolSet< gng::GenericString<int>, int, gng::GenericStringHash<int> > Symbols;
+    typedef Symbols::Map Map;
+
+    struct TrieNode {
+        int wid_;     // the ID of the word ending here, or -1
+        int parent_;  // the parent node
+        int char_;    // the character on the edge from the parent
+        int words_;   // the number of words ending at or below this node
+    };
+
+protected:
+
+    Symbols symbols_;
+
+    // the trie nodes, where node 0 is the root and the empty string,
+    //  and the edges (parent,char) -> child
+    std::vector<TrieNode> nodes_;
+    std::vector<int> reuse_;
+    std::unordered_map<unsigned long long,int> edges_;
+
+    // the vocabulary epoch is advanced by every word birth and death. each
+    //  ID records the epoch it was born in, and each bucket of word hashes
+    //  records the last birth, so cached lookups can be checked cheaply
+    unsigned epoch_;
+    std::vector<unsigned> born_;
+    std::vector<unsigned> hashBorn_;
+
+    // an open-addressed hash of word IDs, or -1 for empty slots, keyed by
+    //  the characters of the words
+    std::vector<int> views_;
+    int viewCount_;
+
+    mutable pthread_rwlock_t lock_;
+    bool concurrent_;
+
+    void lockWrite() { if(concurrent_) pthread_rwlock_wrlock(&lock_); }
+
+    // the symbol set can't be assigned safely
+    WSVocab & operator=(const WSVocab & vocab);
+
+    static unsigned long long edgeKey(int node, int c) {
+        return ((unsigned long long)node << 32) | (unsigned)c;
+    }
+
+    int addNode(int parent, int c) {
+        TrieNode tn = { -1, parent, c, 0 };
+        int ret;
+        if(reuse_.size()) {
+            ret = reuse_.back(); reuse_.pop_back();
+            nodes_[ret] = tn;
+        } else {
+            ret = nodes_.size();
+            nodes_.push_back(tn);
+        }
+        edges_[edgeKey(parent,c)] = ret;
+        return ret;
+    }
+
+    // add a word that is not in the vocabulary yet
+    int addWord(const gng::GenericString<int> & sym) {
+        int id = symbols_.getId(sym, true);
+        addToTrie(sym, id);
+        addView(id);
+        epoch_++;
+        if((int)born_.size() <= id)
+            born_.resize(id+1, UINT_MAX);
+        born_[id] = epoch_;
+        unsigned h = hashStart();
+        for(int i = 0; i < (int)sym.length(); i++)
+            h = hashStep(h, sym[i]);
+        hashBorn_[h & ((1 << HASH_BITS)-1)] = epoch_;
+        return id;
+    }
+
+    static unsigned hashView(const WordSent & sent, int beg, int len) {
+        unsigned h = hashStart();
+        for(int i = beg; i < beg+len; i++)
+            h = hashStep(h, sent[i]);
+        return h ^ (h >> 16);
+    }
+
+    // find the slot of the word at [beg,beg+len) of sent, or the empty slot
+    //  where it would go
+    int findSlot(const WordSent & sent, int beg, int len) const {
+        unsigned mask = views_.size()-1;
+        for(unsigned s = hashView(sent, beg, len) & mask; ; s = (s+1) & mask) {
+            if(views_[s] == -1)
+                return s;
+            const gng::GenericString<int> & sym = symbols_.getSymbol(views_[s]);
+            if((int)sym.length() != len)
+                continue;
+            int i = 0;
+            while(i < len && sym[i] == sent[beg+i]) i++;
+            if(i == len)
+                return s;
+        }
+    }
+
+    void addView(int id) {
+        if((viewCount_+1)*2 > (int)views_.size()) {
+            std::vector<int> old(views_.size()*2, -1);
+            old.swap(views_);
+            for(int i = 0; i < (int)old.size(); i++)
+                if(old[i] != -1) {
+                    const gng::GenericString<int> & sym = symbols_.getSymbol(old[i]);
+                    views_[findSlot(sym, 0, sym.length())] = old[i];
+                }
+        }
+        const gng::GenericString<int> & sym = symbols_.getSymbol(id);
+        views_[findSlot(sym, 0, sym.length())] = id;
+        viewCount_++;
+    }
+
+    // remove a word, moving back the words after it that would no longer be
+    //  found
+    void removeView(int id) {
+        const gng::GenericString<int> & sym = symbols_.getSymbol(id);
+        unsigned mask = views_.size()-1, hole = findSlot(sym, 0, sym.length());
+        views_[hole] = -1;
+        for(unsigned s = (hole+1) & mask; views_[s] != -1; s = (s+1) & mask) {
+            const gng::GenericString<int> & other = symbols_.getSymbol(views_[s]);
+            unsigned home = hashView(other, 0, other.length()) & mask;
+            // move it back unless its home is cyclically in (hole,s]
+            if(hole < s ? (home <= hole || home > s) : (home <= hole && home > s)) {
+                views_[hole] = views_[s];
+                views_[s] = -1;
+                hole = s;
+            }
+        }
+        viewCount_--;
+    }
+
+    void addToTrie(const gng::GenericString<int> & str, int wid) {
+        int node = 0;
+        nodes_[0].words_++;
+        for(int i = 0; i < (int)str.length(); i++) {
+            int next = getChild(node, str[i]);
+            node = (next == -1 ? addNode(node, str[i]) : next);
+            nodes_[node].words_++;
+        }
+        nodes_[node].wid_ = wid;
+    }
+
+    // remove the word from the trie, deleting nodes that no longer lead to words
+    void removeFromTrie(const gng::GenericString<int> & str) {
+        int node = 0;
+        for(int i = 0; i < (int)str.length(); i++)
+            node = getChild(node, str[i]);
+        nodes_[node].wid_ = -1;
+        while(node != 0) {
+            int parent = nodes_[node].parent_;
+            if(--nodes_[node].words_ == 0) {
+                edges_.erase(edgeKey(parent, nodes_[node].char_));
+                reuse_.push_back(node);
+            }
+            node = parent;
+        }
+        nodes_[0].words_--;
+    }
+
+public:
+
+    static const int HASH_BITS = 16;
+
+    WSVocab() : epoch_(0), hashBorn_(1 << HASH_BITS, 0), views_(16, -1), viewCount_(0), concurrent_(false) {
+        TrieNode root = { -1, -1, -1, 0 };
+        nodes_.push_back(root);
+        pthread_rwlock_init(&lock_, NULL);
+    }
+    // copies get their own lock, and are not concurrent
+    WSVocab(const WSVocab & vocab) : symbols_(vocab.symbols_), nodes_(vocab.nodes_),
+            reuse_(vocab.reuse_), edges_(vocab.edges_), epoch_(vocab.epoch_),
+            born_(vocab.born_), hashBorn_(vocab.hashBorn_), views_(vocab.views_),
+            viewCount_(vocab.viewCount_), concurrent_(false) {
+        pthread_rwlock_init(&lock_, NULL);
+    }
+    ~WSVocab() {
+        pthread_rwlock_destroy(&lock_);
+    }
+
+    // the hash used to record births, built up one character at a time
+    static unsigned hashStep(unsigned h, int c) {
+        return (h ^ (unsigned)c) * 16777619u;
+    }
+    static unsigned hashStart() { return 2166136261u; }
+
+    // allow (or stop allowing) words to be looked up and added by several
+    //  threads at once, which must be turned off before removing words
+    void setConcurrent(bool conc) { concurrent_ = conc; }
+
+    // hold the vocabulary unchanged while reading it, for callers that make
+    //  many lookups through the trie
+    void lockRead() const { if(concurrent_) pthread_rwlock_rdlock(&lock_); }
+    void unlock() const { if(concurrent_) pthread_rwlock_unlock(&lock_); }
+
+    // the symbol set interface, which keeps the trie up to date
+    int getId(const gng::GenericString<int> & sym, bool add) {
+        int id = getId(sym);
+        if(id == -1 && add) {
+            lockWrite();
+            // another thread may have added it since
+            id = symbols_.getId(sym, false);
+            if(id == -1)
+                id = addWord(sym);
+            unlock();
+        }
+        return id;
+    }
+    int getId(const gng::GenericString<int> & sym) const {
+        lockRead();
+        int id = symbols_.getId(sym);
+        unlock();
+        return id;
+    }
+    // look up the word at [beg,beg+len) of a sentence without building it,
+    //  which is only built if it is new and add is true
+    int getId(const WordSent & sent, int beg, int len, bool add) {
+        lockRead();
+        int id = views_[findSlot(sent, beg, len)];
+        unlock();
+        if(id == -1 && add) {
+            lockWrite();
+            id = views_[findSlot(sent, beg, len)];
+            if(id == -1)
+                id = addWord(sent.substr(beg, len));
+            unlock();
+        }
+        return id;
+    }
+    // the length of a word, which is safe to get while others add words
+    int getLength(int id) const {
+        lockRead();
+        int len = symbols_.getSymbol(id).length();
+        unlock();
+        return len;
+    }
+    void removeId(int id) {
+        removeView(id);
+        removeFromTrie(symbols_.getSymbol(id));
+        symbols_.removeId(id);
+        epoch_++;
+        born_[id] = UINT_MAX; // later than any stamp
+    }
+    unsigned getEpoch() const { return epoch_; }
+    const gng::GenericString<int> & getSymbol(int id) const { return symbols_.getSymbol(id); }
+    size_t size() const { return symbols_.size(); }
+    size_t capacity() const { return symbols_.capacity(); }
+    size_t hashCapacity() const { return symbols_.hashCapacity(); }
+    Map & getMap() { return symbols_.getMap(); }
+
+    // the trie interface, starting from the root node 0
+    int getChild(int node, int c) const {
+        std::unordered_map<unsigned long long,int>::const_iterator it = edges_.find(edgeKey(node,c));
+        return it == edges_.end() ? -1 : it->second;
+    }
+    int getWordId(int node) const { return nodes_[node].wid_; }
+    size_t getTrieSize() const { return nodes_.size() - reuse_.size(); }
+
+    // find the IDs of all words of length 1 to maxLen starting at beg, where
+    //  wids[len-1] is -1 if no word of length len exists
+    void findWords(const WordSent & sent, int beg, int maxLen, int* wids) const {
+        int len = 0, node = 0, end = std::min((int)sent.length(), beg+maxLen);
+        for(int i = beg; i < end && (node = getChild(node, sent[i])) != -1; i++)
+            wids[len++] = nodes_[node].wid_;
+        for( ; len < maxLen; len++)
+            wids[len] = -1;
+    }
+
+    // check whether IDs found by findWords at the epoch "stamp" are still
+    //  correct, where known words must not have died, and unknown words
+    //  must not have been born (or share a hash with a word born) since
+    bool checkWords(const WordSent & sent, int beg, int maxLen, const int* wids, unsigned stamp) const {
+        unsigned h = hashStart();
+        int end = std::min((int)sent.length(), beg+maxLen);
+        for(int i = beg; i < end; i++) {
+            h = hashStep(h, sent[i]);
+            int wid = wids[i-beg];
+            if(wid == -1 ? hashBorn_[h & ((1 << HASH_BITS)-1)] > stamp : born_[wid] > stamp)
+                return false;
+        }
+        return true;
+    }
+
+};
+
+// the IDs of candidate words at every (start,length) of each sentence,
+//  which are kept across iterations and only looked up again for starts
+//  where the vocabulary has changed. sentences are cached in order until
+//  the memory budget is used up, and the rest are looked up every time
+class WSCandidateCache {
+
+protected:
+
+    struct Table {
+        unsigned stamp_;
+        std::vector<int> wids_;
+    };
+
+    std::vector<Table> tables_;
+    std::vector<char> cached_;
+    int maxLen_;
+    size_t reserved_;
+
+public:
+
+    WSCandidateCache() : maxLen_(0), reserved_(0) { }
+
+    // copies only have the space for tables, not their contents
+    WSCandidateCache(const WSCandidateCache & cache) : tables_(cache.tables_.size()),
+        cached_(cache.cached_), maxLen_(cache.maxLen_), reserved_(cache.reserved_) { }
+
+    // decide which sentences to cache given a budget in bytes
+    void initialize(const CorpusBase<WordSent> & corp, int maxLen, size_t budget) {
+        maxLen_ = maxLen;
+        reserved_ = 0;
+        tables_ = std::vector<Table>(corp.size());
+        cached_ = std::vector<char>(corp.size(), 0);
+        for(int i = 0; i < (int)corp.size(); i++) {
+            size_t need = corp[i].length()*maxLen*sizeof(int);
+            if(reserved_ + need <= budget) {
+                cached_[i] = 1;
+                reserved_ += need;
+            }
+        }
+    }
+
+    // get the word IDs for sentence sid, where the ID for (beg,len) is at
+    //  beg*maxLen+len-1. uncached sentences are looked up in "scratch"
+    const int* getWords(const WSVocab & vocab, int sid, const WordSent & sent, std::vector<int> & scratch) {
+        int ss = sent.length();
+        vocab.lockRead();
+        unsigned now = vocab.getEpoch();
+        if(sid >= (int)cached_.size() || !cached_[sid]) {
+            scratch.resize(ss*maxLen_);
+            for(int beg = 0; beg < ss; beg++)
+                vocab.findWords(sent, beg, maxLen_, &scratch[beg*maxLen_]);
+            vocab.unlock();
+            return &scratch[0];
+        }
+        Table & tab = tables_[sid];
+        if(tab.wids_.size() == 0) {
+            tab.wids_.resize(ss*maxLen_);
+            for(int beg = 0; beg < ss; beg++)
+                vocab.findWords(sent, beg, maxLen_, &tab.wids_[beg*maxLen_]);
+        } else if(tab.stamp_ != now) {
+            for(int beg = 0; beg < ss; beg++)
+                if(!vocab.checkWords(sent, beg, maxLen_, &tab.wids_[beg*maxLen_], tab.stamp_))
+                    vocab.findWords(sent, beg, maxLen_, &tab.wids_[beg*maxLen_]);
+        }
+        vocab.unlock();
+        tab.stamp_ = now;
+        return &tab.wids_[0];
+    }
+
+    // the number of sentences cached, and the bytes reserved for them
+    int getCachedCount() const { return std::count(cached_.begin(), cached_.end(), 1); }
+    size_t getMemoryUsage() const { return reserved_; }
+
+};
+
+}
+
+#endif
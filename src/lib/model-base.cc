@@ -1,8 +1,12 @@
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include "pgibbs/model-base.h"
 #include "pgibbs/model-hmm.h"
 #include "pgibbs/model-ws.h"
 #include "gng/misc-func.h"
+#include "gng/perf-counter.h"
 
 using namespace pgibbs;
 
@@ -40,7 +44,12 @@ public:
     int accepted_, sents_;
     vector<int> sentAccepted_;
 
-    BlockJob(ModelBase<Sent,Labs> * mod, CorpusBase<Sent> * corp, LabelsBase<Sent,Labs> * labs) : mod_(mod), corp_(corp), labs_(labs) { };
+    // the random stream of the thread, used when useSeed_ is set instead
+    //  of the shared rand()
+    unsigned seed_;
+    bool useSeed_;
+
+    BlockJob(ModelBase<Sent,Labs> * mod, CorpusBase<Sent> * corp, LabelsBase<Sent,Labs> * labs) : mod_(mod), corp_(corp), labs_(labs), seed_(0), useSeed_(false) { };
     
     void setNumSents(int numSents) {
         numSents_ = numSents;
@@ -72,6 +81,7 @@ void ModelBase<Sent,Labs>::initialize(CorpusBase<Sent> & corp, LabelsBase<Sent,L
     iters_ = conf_.getInt("iters");
     doShuffle_ = conf_.getBool("shuffle");
     skipIters_ = conf_.getInt("skipiters");
+    sentIters_ = conf_.getInt("sentiters");
     printModel_ = conf_.getBool("printmod");
     numThreads_ = conf_.getInt("threads"); blockSize_ = conf_.getInt("blocksize"); 
     sentAccepted_ = vector<int>(cs,0);
@@ -122,6 +132,8 @@ void ModelBase<Sent,Labs>::printIterationResult(int iter, const CorpusBase<Sent>
     cout << endl << "Iteration "<<iter<< " (time: "<<iterTime_<<"s)" << endl
          << " Likelihood: "<<likelihood_<<endl
          << " Acceptance rate: "<<100.0*accepted_/labs.size() <<"%" << endl;
+    if(verbose_ > 0 && iterMisses_ >= 0)
+        cout << " Cache misses: "<<iterMisses_<<endl;
 }
 
 // perform a single sampling pass over the sentences in myOrder
@@ -130,6 +142,8 @@ template <class Sent, class Labs>
 void* samplingPass(void* ptr) {
     BlockJob<Sent,Labs> & job = *(BlockJob<Sent,Labs>*)ptr;
     job.likelihood_ = 0; job.accepted_ = 0; job.sents_ = 0;
+    unsigned * seed = (job.useSeed_ ? &job.seed_ : 0);
+    ModelBase<Sent,Labs>::threadSeed() = seed;
 
     // perform sampling in sequence
     double accept;
@@ -149,7 +163,7 @@ void* samplingPass(void* ptr) {
         if(job.mod_->getVerbose() > 0)
             cout << s << " (tn=" <<trueProbs.second<<")-(tc="<<trueProbs.first<<")+(pc="<<propProbs.first<<")-(pn="<<propProbs.second<<") == " <<accept;
 
-        if(job.mod_->getSkipIters() >= job.iter_ || accept >= 0 || bernoulliSample(exp(accept))) {
+        if(job.mod_->getSkipIters() >= job.iter_ || accept >= 0 || bernoulliSample(exp(accept),seed)) {
             if(job.mod_->getVerbose() > 0)
                 cout << ": accept"<<endl;
             job.accepted_++;
@@ -158,9 +172,8 @@ void* samplingPass(void* ptr) {
         } else {
             if(job.mod_->getVerbose() > 0)
                 cout << ": reject"<<endl;
-            job.mod_->removeSentence(s,(*job.corp_)[s],(*job.labs_)[s]);
+            job.mod_->replaceSentence(s,(*job.corp_)[s],(*job.labs_)[s],oldTags);
             (*job.labs_)[s] = oldTags;
-            job.mod_->addSentence(s,(*job.corp_)[s],(*job.labs_)[s]);
             job.likelihood_ += trueProbs.first;
         }
 
@@ -170,6 +183,33 @@ void* samplingPass(void* ptr) {
         }
 
     }
+    ModelBase<Sent,Labs>::threadSeed() = 0;
+    return NULL;
+
+}
+
+// resample the labels of the sentences in myOrder one at a time, keeping
+//  each sentence in the model. the likelihood of the job is the change in
+//  likelihood over the pass, not the likelihood itself
+template <class Sent, class Labs>
+void* pointwisePass(void* ptr) {
+    BlockJob<Sent,Labs> & job = *(BlockJob<Sent,Labs>*)ptr;
+    job.likelihood_ = 0; job.accepted_ = 0; job.sents_ = 0;
+
+    bool changed;
+    for(int i = 0; i < job.getNumSents(); i++) {
+        int s=job.sentOrder_[i];
+        job.likelihood_ += job.mod_->samplePointwise(s,(*job.corp_)[s],(*job.labs_)[s],changed);
+        if(changed) {
+            job.accepted_++;
+            job.sentAccepted_[i]++;
+        }
+
+        if(++job.sents_ % 1000 == 0 && job.mod_->getPrintStatus()) {
+            cerr << "\r" << job.sents_;
+            cerr.flush();
+        }
+    }
     return NULL;
 
 }
@@ -186,6 +226,7 @@ void ModelBase<Sent,Labs>::trainInSequence(CorpusBase<Sent> & corp, LabelsBase<S
     printStatus_ = true;
     sentAccepted_ = vector<int>(cs,0);
     timeval tStart, tEnd;
+    gng::PerfCounter misses;
 
     // make the job
     BlockJob<Sent,Labs> job(this,&corp,&labs);
@@ -201,11 +242,13 @@ void ModelBase<Sent,Labs>::trainInSequence(CorpusBase<Sent> & corp, LabelsBase<S
 
         // do a sampling pass over the whole corpus 
         gettimeofday(&tStart, NULL);
+        misses.start();
         job.iter_ = iter;
         samplingPass<Sent,Labs>(&job);
         likelihood_ = job.likelihood_; accepted_ = job.accepted_;
         gettimeofday(&tEnd, NULL);
         iterTime_ = timeDifference(tStart,tEnd);
+        iterMisses_ = misses.stop();
 
         // print information about the iteration
         printIterationResult(iter,corp,labs);
@@ -229,6 +272,7 @@ void ModelBase<Sent,Labs>::trainInParallel(CorpusBase<Sent> & corp, LabelsBase<S
     int cs = corp.size();
     printStatus_ = true;
     timeval tStart, tEnd;
+    gng::PerfCounter misses;
     
     // divide the parts of the array to be handled by each thread
     vector< BlockJob<Sent,Labs> > jobs(numThreads_, BlockJob<Sent,Labs>(this,&corp,&labs) );
@@ -246,6 +290,7 @@ void ModelBase<Sent,Labs>::trainInParallel(CorpusBase<Sent> & corp, LabelsBase<S
 
         likelihood_ = 0; accepted_ = 0;
         gettimeofday(&tStart, NULL);
+        misses.start();
         
         // initialize the models for each thread and do a sampling pass
         for(int i = 0; i < numThreads_; i++) {
@@ -272,6 +317,7 @@ void ModelBase<Sent,Labs>::trainInParallel(CorpusBase<Sent> & corp, LabelsBase<S
         
         gettimeofday(&tEnd, NULL);
         iterTime_ = timeDifference(tStart,tEnd);
+        iterMisses_ = misses.stop();
         
         // print information about the iteration
         printIterationResult(iter,corp,labs);
@@ -316,6 +362,7 @@ void ModelBase<Sent,Labs>::trainInBlocks(CorpusBase<Sent> & corp, LabelsBase<Sen
     vector<Labs> oldLabs(blockSize_);    // old labels to save
     vector< BlockJob<Sent,Labs> > jobs(numThreads_,BlockJob<Sent,Labs>(this,&corp,&labs));  // jobs
     timeval tStart, tEnd;
+    gng::PerfCounter misses;
 
     // perform training
     for(int iter = 1; iter <= iters_; iter++) {
@@ -330,6 +377,7 @@ void ModelBase<Sent,Labs>::trainInBlocks(CorpusBase<Sent> & corp, LabelsBase<Sen
         double accept = 0.0;
         
         gettimeofday(&tStart, NULL);
+        misses.start();
         
         // for each block
         for(int i = 0; i < cs; i += blockSize_) {
@@ -385,9 +433,8 @@ void ModelBase<Sent,Labs>::trainInBlocks(CorpusBase<Sent> & corp, LabelsBase<Sen
                     cout << ": rejected"<<endl;
                 for(int j = 0; j < myBlock; j++) {
                     int s = sentOrder_[i+j];
-                    removeSentence(s,corp[s],labs[s]);
+                    replaceSentence(s,corp[s],labs[s],oldLabs[j]);
                     labs[s] = oldLabs[j];
-                    addSentence(s,corp[s],labs[s]);
                 }
                 likelihood_ += trueProbs.first;
             }
@@ -406,6 +453,7 @@ void ModelBase<Sent,Labs>::trainInBlocks(CorpusBase<Sent> & corp, LabelsBase<Sen
         }
         gettimeofday(&tEnd, NULL);
         iterTime_ = timeDifference(tStart,tEnd);
+        iterMisses_ = misses.stop();
  
         // print information about the iteration
         printIterationResult(iter,corp,labs);
@@ -430,6 +478,7 @@ void ModelBase<Sent,Labs>::trainInBlocksSingle(CorpusBase<Sent> & corp, LabelsBa
     vector<Labs> oldLabs(blockSize_);    // old labels to save
     vector< BlockJob<Sent,Labs> > jobs(numThreads_,BlockJob<Sent,Labs>(this,&corp,&labs));  // jobs
     timeval tStart, tEnd;
+    gng::PerfCounter misses;
 
     // perform training
     for(int iter = 1; iter <= iters_; iter++) {
@@ -444,6 +493,7 @@ void ModelBase<Sent,Labs>::trainInBlocksSingle(CorpusBase<Sent> & corp, LabelsBa
         double accept = 0.0;
         
         gettimeofday(&tStart, NULL);
+        misses.start();
         
         // for each block
         for(int i = 0; i < cs; i += blockSize_) {
@@ -507,9 +557,8 @@ void ModelBase<Sent,Labs>::trainInBlocksSingle(CorpusBase<Sent> & corp, LabelsBa
                     } else {
                         if(verbose_ > 0)
                             cout << ": reject"<<endl;
-                        removeSentence(s,corp[s],labs[s]);
+                        replaceSentence(s,corp[s],labs[s],oldLabs[samp_id]);
                         labs[s] = oldLabs[samp_id];
-                        addSentence(s,corp[s],labs[s]);
                         likelihood_ += trueProbs.first;
                     }
 
@@ -531,6 +580,7 @@ void ModelBase<Sent,Labs>::trainInBlocksSingle(CorpusBase<Sent> & corp, LabelsBa
         }
         gettimeofday(&tEnd, NULL);
         iterTime_ = timeDifference(tStart,tEnd);
+        iterMisses_ = misses.stop();
  
         // print information about the iteration
         printIterationResult(iter,corp,labs);
@@ -542,6 +592,136 @@ void ModelBase<Sent,Labs>::trainInBlocksSingle(CorpusBase<Sent> & corp, LabelsBa
     }
 }
 
+// train asynchronously, where each thread samples its share of the corpus
+//  in sequence against the same model, adding each sample to the model as
+//  soon as it is accepted. there is no clone and no barrier within an
+//  iteration, and threads see each other's changes as they happen
+template <class Sent, class Labs>
+void ModelBase<Sent,Labs>::trainInAsync(CorpusBase<Sent> & corp, LabelsBase<Sent,Labs> & labs) {
+
+    // initialize the model
+    initialize(corp,labs,true);
+
+    // training variables
+    int cs = corp.size();
+    printStatus_ = true;
+    timeval tStart, tEnd;
+    gng::PerfCounter misses;
+
+    // divide the parts of the array to be handled by each thread
+    vector< BlockJob<Sent,Labs> > jobs(numThreads_, BlockJob<Sent,Labs>(this,&corp,&labs) );
+    for(int i = 0; i < numThreads_; i++) {
+        jobs[i].sentOrder_ = (&sentOrder_[0])+i*cs/numThreads_;
+        jobs[i].setNumSents((i+1)*cs/numThreads_ - i*cs/numThreads_);
+    }
+
+    // perform training
+    for(int iter = 1; iter <= iters_; iter++) {
+
+        // shuffle the sentences and divide them appropriately
+        if(doShuffle_) 
+            shuffle(sentOrder_);
+
+        likelihood_ = 0; accepted_ = 0;
+        gettimeofday(&tStart, NULL);
+        misses.start();
+
+        // sample in all threads at once on the shared model, each drawing
+        //  from its own stream so that they do not contend on rand()
+        setConcurrent(true);
+        for(int i = 0; i < numThreads_; i++) {
+            jobs[i].iter_ = iter;
+            jobs[i].seed_ = randSample();
+            jobs[i].useSeed_ = true;
+            pthread_create( &jobs[i].thread_, NULL, samplingPass<Sent,Labs>, (void*) &jobs[i]);
+        }
+        for(int i = 0; i < numThreads_; i++) {
+            pthread_join(jobs[i].thread_, NULL);
+            likelihood_ += jobs[i].likelihood_;
+            accepted_ += jobs[i].accepted_;
+        }
+        setConcurrent(false);
+
+        gettimeofday(&tEnd, NULL);
+        iterTime_ = timeDifference(tStart,tEnd);
+        iterMisses_ = misses.stop();
+
+        // print information about the iteration
+        printIterationResult(iter,corp,labs);
+
+        // sample the parameters
+        if(sampParam_)
+            sampleParameters();
+
+    }
+
+}
+
+// train via pointwise gibbs sampling, where the labels that changed are
+//  reported as accepted. every sentIters_ iterations, the sentences are
+//  sampled whole instead, as in trainInSequence. the likelihood is only
+//  computed in full at the start and by those passes. in between, it is
+//  only an estimate updated by the changes that pointwise sampling finds
+//  for each sentence, which miss the effect on other sentences and of
+//  parameter sampling
+template <class Sent, class Labs>
+void ModelBase<Sent,Labs>::trainInPoints(CorpusBase<Sent> & corp, LabelsBase<Sent,Labs> & labs) {
+
+    // initialize the model
+    initialize(corp,labs,true);
+    // find the likelihood of each sentence given the others, as the full
+    //  sampling passes do
+    likelihood_ = 0;
+    for(int s = 0; s < (int)corp.size(); s++) {
+        removeSentence(s,corp[s],labs[s]);
+        likelihood_ += addSentence(s,corp[s],labs[s]);
+    }
+
+    // training variables
+    int cs = corp.size();
+    printStatus_ = true;
+    sentAccepted_ = vector<int>(cs,0);
+    timeval tStart, tEnd;
+    gng::PerfCounter misses;
+
+    // make the job
+    BlockJob<Sent,Labs> job(this,&corp,&labs);
+    job.sentOrder_ = &sentOrder_[0];
+    job.setNumSents(sentOrder_.size());
+
+    // perform training
+    for(int iter = 1; iter <= iters_; iter++) {
+
+        // shuffle the sentences
+        if(doShuffle_) 
+            shuffle(sentOrder_);
+
+        // do a sampling pass over the whole corpus 
+        gettimeofday(&tStart, NULL);
+        misses.start();
+        job.iter_ = iter;
+        if(sentIters_ > 0 && iter % sentIters_ == 0) {
+            samplingPass<Sent,Labs>(&job);
+            likelihood_ = job.likelihood_;
+        } else {
+            pointwisePass<Sent,Labs>(&job);
+            likelihood_ += job.likelihood_;
+        }
+        accepted_ = job.accepted_;
+        gettimeofday(&tEnd, NULL);
+        iterTime_ = timeDifference(tStart,tEnd);
+        iterMisses_ = misses.stop();
+
+        // print information about the iteration
+        printIterationResult(iter,corp,labs);
+
+        // sample the parameters
+        if(sampParam_)
+            sampleParameters();
+        
+    }
+
+}
 
 namespace pgibbs {
 // make the functions for the HMM model
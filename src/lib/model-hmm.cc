@@ -12,19 +12,16 @@ double HMMModel::addSentence(int sid, const WordSent & sent, const ClassSent & t
     if((int)sentInc_.size()<=sid) sentInc_.resize((sid+1)*2,false);
     if(sentInc_[sid])
         THROW_ERROR("Double-adding sentence "<<sid<<" to model");
-#endif
     sentInc_[sid] = true;
+#endif
     double logProb = 0;
     int sl = sent.length(), i;
     for(i = 1; i < sl-1; i++) {
         // get transition probs and emission probs for all but the last transition
-        logProb += log( 
-                tDists_[tags[i-1]]->add(tags[i],baseT_[tags[i]]) *
-                eDists_[tags[i]]->add(sent[i],baseE_[sent[i]])
-            );
+        logProb += log( addTrans(tags[i-1],tags[i]) * addEmit(tags[i],sent[i]) );
         // cerr << " logProb = "<<logProb<<endl;
     }
-    logProb += log(tDists_[tags[i-1]]->add(tags[i],baseT_[tags[i]])); // get the last
+    logProb += log(addTrans(tags[i-1],tags[i])); // get the last
     return logProb;
 }
 
@@ -36,33 +33,97 @@ double HMMModel::removeSentence(int sid, const WordSent & sent, const ClassSent
     if((int)sentInc_.size()<=sid) sentInc_.resize((sid+1)*2,false);
     if(!sentInc_[sid])
         THROW_ERROR("Double-removing sentence "<<sid<<" from model");
-#endif
     sentInc_[sid] = false;
+#endif
     double logProb = 0;
     int sl = sent.length(), i;
     for(i = 1; i < sl-1; i++) {
         // get transition probs and emission probs for all but the last transition
-        logProb += log( 
-                tDists_[tags[i-1]]->remove(tags[i],baseT_[tags[i]]) *
-                eDists_[tags[i]]->remove(sent[i],baseE_[sent[i]])
-            );
+        logProb += log( removeTrans(tags[i-1],tags[i]) * removeEmit(tags[i],sent[i]) );
     }
-    logProb += log(tDists_[tags[i-1]]->remove(tags[i],baseT_[tags[i]])); // get the last
+    logProb += log(removeTrans(tags[i-1],tags[i])); // get the last
     return logProb;
 }
 
-// cache probabilities that can be used with multiple samples
-void HMMModel::cacheProbabilities() {
-    // calculate the translation matrix
+// calculate the transition matrix, locking each row while it is read
+void HMMModel::makeTransitions(vector<double> & tMat) const {
     int cl = classes_+1, tl = cl*cl, idx=0;
-    tMat_.resize(tl);
-    for(int i = 0; i < cl; i++)
+    tMat.resize(tl);
+    for(int i = 0; i < cl; i++) {
+        tLocks_.lock(i);
         for(int j = 0; j < cl; j++)
-            tMat_[idx++] = log(tDists_[i]->getProb(j,baseT_[j]));
+            tMat[idx++] = log(tDists_[i]->getProb(j,baseT_[j]));
+        tLocks_.unlock(i);
+    }
+}
+
+// cache probabilities that can be used with multiple samples
+void HMMModel::cacheProbabilities() {
+    if(!async_) {
+        makeTransitions(tMat_);
+        return;
+    }
+    // when asynchronous, the thread that finishes every refresh_-th sentence
+    //  replaces the shared matrix, and records how far the old one drifted
+    if(++sinceRefresh_ % refresh_ != 0)
+        return;
+    vector<double>* tMat = new vector<double>;
+    makeTransitions(*tMat);
+    std::shared_ptr< const vector<double> > old = std::atomic_load(&tShared_);
+    double drift = 0;
+    for(int i = 0; i < (int)tMat->size(); i++)
+        drift = max(drift, fabs((*tMat)[i]-(*old)[i]));
+    std::atomic_store(&tShared_, std::shared_ptr< const vector<double> >(tMat));
+    statLock_.lock(0);
+    refreshes_++;
+    driftSum_ += drift;
+    driftMax_ = max(driftMax_, drift);
+    statLock_.unlock(0);
+}
+
+// copy the emission probabilities of a word for the calling thread if its
+//  copy is from an earlier refresh period. this is the only time emissions
+//  are read while they are shared, so only this and add/remove take locks
+const double* HMMModel::getLogEmits(int word, HMMEmitCache & cache, int period) const {
+    vector<double> & emits = cache.emits_[word];
+    if(cache.periods_[word] != period) {
+        emits.resize(classes_);
+        for(int j = 0; j < classes_; j++) {
+            eLocks_.lock(j);
+            emits[j] = log(getEmit(j,word));
+            eLocks_.unlock(j);
+        }
+        cache.periods_[word] = period;
+    }
+    return &emits[0];
+}
+
+// start or stop asynchronous sampling, and report the drift of the shared
+//  transition matrix when stopping
+void HMMModel::setConcurrent(bool conc) {
+    if(conc == async_) return;
+    if(conc) {
+        if(refresh_ < 1)
+            THROW_ERROR("-refresh must be at least 1, but is "<<refresh_);
+        vector<double>* tMat = new vector<double>;
+        makeTransitions(*tMat);
+        tShared_ = std::shared_ptr< const vector<double> >(tMat);
+        sinceRefresh_ = 0;
+        serial_ = nextSerial();
+        refreshes_ = 0; driftSum_ = 0; driftMax_ = 0;
+    } else {
+        tShared_.reset();
+        // the drift of a refresh is the largest change in any log probability
+        cerr << " trefreshes="<<refreshes_<<", tdrift="<<driftSum_/max(refreshes_,1)<<" (mean), "<<driftMax_<<" (max)"<<endl;
+    }
+    async_ = conc;
+    tLocks_.setActive(conc);
+    eLocks_.setActive(conc);
+    statLock_.setActive(conc);
 }
 
 // calculate a sample (if necessary) and return the posterior probability
-double HMMModel::backwardStep(const vector<double> & forProbs, ClassSent & tags, bool sample) const {
+double HMMModel::backwardStep(const vector<double> & tMat, const vector<double> & forProbs, ClassSent & tags, bool sample) const {
     // for each word, backwards
     int cl = classes_+1, sl = tags.length()-1;
     vector<double> myTrans(classes_);
@@ -71,13 +132,13 @@ double HMMModel::backwardStep(const vector<double> & forProbs, ClassSent & tags,
         // for each potential tag
         int prev = tags[i+1];
         for(int j = 0; j < classes_; j++) {
-            myTrans[j] = tMat_[j*cl+prev] + forProbs[i*cl+j];
+            myTrans[j] = tMat[j*cl+prev] + forProbs[i*cl+j];
             // cout << " myTrans["<<j<<"]("<<myTrans[j]<<") = tMat_["<<j*cl+prev<<"]("<<tMat_[j*cl+prev]<<") + forProbs["<<i*cl+j<<"]("<<forProbs[i*cl+j]<<")"<<endl;
         }
         normalizeLogProbs(myTrans);
         // sample if necessary
         if(sample) 
-            tags[i] = sampleProbs(myTrans);
+            tags[i] = sampleProbs(myTrans, threadSeed());
 #ifdef DEBUG_ON
         if(tags[i] > classes_)
             THROW_ERROR("Found a tag "<<tags[i]<<" larger than a class "<<classes_);
@@ -94,10 +155,22 @@ pair<double,double> HMMModel::sampleSentence(int sid, const WordSent & sent, Cla
     // initialize
     int cl = classes_+1, sl = newTags.length()-1;
 
+    // when asynchronous, hold on to the current shared transition matrix,
+    //  and read emissions from this thread's copy for the current period
+    std::shared_ptr< const vector<double> > tShared;
+    static thread_local HMMEmitCache eCache;
+    int period = 0;
+    if(async_) {
+        tShared = std::atomic_load(&tShared_);
+        eCache.bind(serial_, baseE_.size());
+        period = sinceRefresh_ / refresh_;
+    }
+    const vector<double> & tMat = (async_ ? *tShared : tMat_);
+
     // sanity check
 #ifdef DEBUG_ON
-    if((int)tMat_.size() != cl*cl)
-        THROW_ERROR("Transition matrix size "<<tMat_.size()<<" is not " << cl*cl);
+    if((int)tMat.size() != cl*cl)
+        THROW_ERROR("Transition matrix size "<<tMat.size()<<" is not " << cl*cl);
     if(sent.length() != newTags.length())
         THROW_ERROR("Sentence size "<<sent.length()<<" != tag size "<<newTags.length());
     if(sid<(int)sentInc_.size() && sentInc_[sid])
@@ -111,24 +184,24 @@ pair<double,double> HMMModel::sampleSentence(int sid, const WordSent & sent, Cla
     // calculate the emission matrix and forward step
     // pos in sentence
     for(int i = 1; i < sl; i++) {
+        const double* logEmits = (async_ ? getLogEmits(sent[i],eCache,period) : 0);
         // current class
         for(int j = 0; j < classes_; j++) {
             // previous class
             for(int k = 0; k < cl; k++) {
                 // cerr << "for: myTrans["<<k<<"] = forProbs["<<(i-1)*cl+k<<"]("<<forProbs[(i-1)*cl+k]<<") + tMat_["<<k*cl+j<<"]("<<tMat_[k*cl+j]<<")"<<endl;
-                myTrans[k] = forProbs[(i-1)*cl+k] + tMat_[k*cl+j];
+                myTrans[k] = forProbs[(i-1)*cl+k] + tMat[k*cl+j];
             }
             // sum the values
             // cerr << "setting forProbs["<<i<<"*cl+"<<j<<"] = "<<addLogProbs(myTrans) <<" + "<<log(eDists_[j]->getProb(sent[i],baseE_[sent[i]]))<<endl;
-            forProbs[i*cl+j] = addLogProbs(myTrans) + 
-                                log(eDists_[j]->getProb(sent[i],baseE_[sent[i]]));
+            forProbs[i*cl+j] = addLogProbs(myTrans) + (logEmits ? logEmits[j] : log(getEmit(j,sent[i])));
         }
     }
     
     // sample backwards
     myTrans.resize(classes_);
-    double probOld = backwardStep(forProbs,oldTags,false);
-    double probNew = backwardStep(forProbs,newTags,true);
+    double probOld = backwardStep(tMat,forProbs,oldTags,false);
+    double probNew = backwardStep(tMat,forProbs,newTags,true);
     
     return pair<double,double>(probOld,probNew);
 
@@ -155,7 +228,13 @@ void HMMModel::initialize(CorpusBase<WordSent> & corp, LabelsBase<WordSent,Class
 
 // sample the parameters
 void HMMModel::sampleParameters() {
-    pair<double,double> tpar = PyDist<PyDenseIndex>::sampleParameters(tDists_,tStrA_,tStrB_,tDiscA_,tDiscB_);
-    pair<double,double> epar = PyDist<PySparseIndex>::sampleParameters(eDists_,eStrA_, eStrB_, eDiscA_, eDiscB_);
+    pair<double,double> tpar = PyDist<PyDenseIndex,PyHistTableSet>::sampleParameters(tDists_,tStrA_,tStrB_,tDiscA_,tDiscB_,numThreads_);
+    pair<double,double> epar = PyDist<PyAdaptiveIndex,PyHistTableSet>::sampleParameters(eDists_,eStrA_, eStrB_, eDiscA_, eDiscB_,numThreads_);
     cerr << "tstr="<<tpar.first<<", tdisc="<<tpar.second<< ", estr="<<epar.first<<", edisc="<<epar.second << endl;
+    size_t eMem = 0; int eEntries = 0;
+    for(int i = 0; i < (int)eDists_.size(); i++) {
+        eMem += eDists_[i]->getMemoryUsage();
+        eEntries += eDists_[i]->getEntryCount();
+    }
+    cerr << "ememory="<<eMem<<", eentries="<<eEntries<<" ("<<(double)eMem/max(eEntries,1)<<" bytes/entry)" << endl;
 }
@@ -1,28 +1,24 @@
 
 #include "pgibbs/model-ws.h"
 #include "pgibbs/definitions.h"
+#include "gng/samp-gen.h"
+#include <sys/time.h>
 
 using namespace pgibbs;
 
-// make words from bounds
-WordSent WSModel::makeWords(const WordSent & chars, const Bounds & bounds, bool add) {
+// make words from bounds, looking each one up as a view of the characters
+void WSModel::makeWords(const WordSent & chars, const Bounds & bounds, bool add, vector<int> & words) {
 #ifdef DEBUG_ON
     if(chars.length() != bounds.size())
         THROW_ERROR("WSModel::makeWords, chars.size="<<chars.length()<<", bounds.size="<<bounds.size());
 #endif
-    vector<int> beg(1,0);
-    for(int i = 0; i < (int)bounds.size(); i++)
-        if(bounds[i])
-            beg.push_back(i+1);
-    WordSent ws(beg.size());
-    for(int i = 1; i < (int)beg.size(); i++) {
-        if(beg[i]-beg[i-1]>maxLen_)
-            THROW_ERROR("String length "<<beg[i]-beg[i-1]<<" (@"<<i<<") exceeded maximum length"<<maxLen_);
-        ws[i-1] = symbols_.getId(chars.substr(beg[i-1],beg[i]-beg[i-1]),add);
-        // cerr << "adding word "<<ws[i-1]<<" substr("<<beg[i-1]<<","<<beg[i]-beg[i-1]<<")"<<endl;
+    words.clear();
+    for(int beg = 0, i; (i = bounds.next(beg)) < (int)bounds.size(); beg = i+1) {
+        if(i+1-beg>maxLen_)
+            THROW_ERROR("String length "<<i+1-beg<<" (@"<<words.size()+1<<") exceeded maximum length"<<maxLen_);
+        words.push_back(symbols_.getId(chars,beg,i+1-beg,add));
     }
-    ws[beg.size()-1] = initId_;
-    return ws;
+    words.push_back(initId_);
 }
 
 double WSModel::getBase(const GenericString<int> & str) const {
@@ -30,7 +26,7 @@ double WSModel::getBase(const GenericString<int> & str) const {
     return bases_[str.length()];
 }
 double WSModel::getBase(int wid) const {
-    return getBase(symbols_.getSymbol(wid));
+    return bases_[symbols_.getLength(wid)];
 }
 
 // add the sentence and return the log probability
@@ -42,21 +38,10 @@ double WSModel::addSentence(int sid, const WordSent & sent, const Bounds & bound
     sentInc_[sid] = true;
 #endif
     // add the sent
-    WordSent tags = makeWords(sent,bounds,true);
-    double logProb = 0;
-    for(int i = 0; i < (int)tags.length(); i++) {
-        int node = 0;
-        for(int j = i-1; i-j<n_ && j >= -1; j--) {
-            // cerr << endl<<"addnode("<<tags[j]<<") "<<node; // HERE
-            node = lm_.getChild(node,(j==-1?initId_:tags[j]),true,lm_.getStrength(i-j), lm_.getDisc(i-j));
-            // cerr << " --> "<<node<<endl;
-        }
-        double myProb = log(lm_.addCust(node,tags[i],getBase(tags[i])));
-        logProb += myProb;
-        // cerr << " a(n="<<node<<",t="<<tags[i]<<",l="<<symbols_.getSymbol(tags[i]).length()<<",p="<<myProb<<")" << endl;
-    }
-    // cerr << endl;
-    return logProb;
+    if(!async_) memo_.clear();
+    static thread_local vector<int> tags;
+    makeWords(sent,bounds,true,tags);
+    return changeWords(tags,0,tags.size(),true);
 }
 
 // remove the sentence and return the log probability
@@ -67,16 +52,18 @@ double WSModel::removeSentence(int sid, const WordSent & sent, const Bounds & bo
     sentInc_[sid] = false;
 #endif
     // add the sent
-    WordSent tags = makeWords(sent,bounds,false);
+    if(!async_) memo_.clear();
+    static thread_local vector<int> tags;
+    makeWords(sent,bounds,false,tags);
     double logProb = 0;
-    for(int i = 0; i < (int)tags.length(); i++) {
+    for(int i = 0; i < (int)tags.size(); i++) {
         int node = 0;
         for(int j = i-1; i-j<n_ && j >= -1; j--) {
             // cerr << endl<<"remnode("<<tags[j]<<") "<<node;
             node = lm_.getChild(node,(j==-1?initId_:tags[j]),false,0,0);
             // cerr << " --> "<<node<<endl;
         }
-        double myProb = log(lm_.removeCust(node,tags[i],getBase(tags[i]))); 
+        double myProb = log(lm_.removeCust(node,tags[i],getBase(tags[i]),threadSeed())); 
         logProb += myProb;
         // cerr << " r(n="<<node<<",t="<<tags[i]<<",l="<<symbols_.getSymbol(tags[i]).length()<<",p="<<myProb<<")" << endl;
     }
@@ -84,143 +71,417 @@ double WSModel::removeSentence(int sid, const WordSent & sent, const Bounds & bo
     return logProb;
 }
 
-// calculate a sample (if necessary) and return the posterior probability
-double WSModel::backwardStep(const WordSent & chars, const vector<Stack> & stacks, Bounds & bounds, bool sample) const {
+// calculate a sample (if necessary) and return the posterior probability,
+//  for a lattice over the characters of a sentence from beg that starts at
+//  the LM state node
+double WSModel::backwardStep(const int* wids, const WSLattice & lattice, Bounds & bounds, int beg, int node, bool sample) const {
     
-    // get the stack to start
-    int ss = stacks.size();
+    int len = lattice.getPositionCount()-2;
 
     // if we are not sampling, convert the bounds into a path through the lattice
     vector< pair<int,int> > path;
     if(sample == false) {
-        WordSent tags = const_cast<WSModel*>(this)->makeWords(chars,bounds,false);
-        path.push_back(pair<int,int>(0,initNode_));
-        // cerr << "Lattice 0 (0,"<<initNode_<<")"<<endl;
-        int currNode = initNode_;
-        int idx = 0;
-        for(int i = 0; i < (int)tags.length()-1; i++) {
-            currNode = lm_.getNext(currNode,tags[i]);
-            while(!bounds[idx++]);
-            // cerr << "Lattice "<<i+1<<" ("<<idx<<","<<currNode<<") t="<<tags[i]<<endl;
-            path.push_back(pair<int,int>(idx,currNode));
+        path.push_back(pair<int,int>(0,node));
+        for(int i, last = beg; (i = bounds.next(last)) < beg+len; last = i+1) {
+            node = lm_.getNext(node,wids[last*maxLen_+i-last]);
+            path.push_back(pair<int,int>(i+1-beg,node));
         }
     }
 
-    // start at the end of the stack 
+    // start at the single state in the final position
     double logProb = 0;
-    const SegHyp* currHyp = &(stacks[ss-1].begin()->second);
-    vector< pair<int,int> > links = currHyp->links_;
-    Bounds oldBounds = bounds;
-    for(int i = 0; i < (int)bounds.size(); i++) bounds[i] = 0;
-    while(links.size() != 0) {
+    int curr = lattice.getPosBegin(lattice.getPositionCount()-1);
+    bounds.clear(beg, beg+len);
+    while(lattice.getState(curr).linkBeg_ != lattice.getState(curr).linkEnd_) {
+        const WSLattice::State & st = lattice.getState(curr);
         int nextLink;
-        vector<double> myTrans = currHyp->linkProbs_;
-        normalizeLogProbs(myTrans);
         // choose which link to use, sample if necessary
         if(sample) {
-            nextLink = sampleProbs(myTrans);
-            // cerr << "  selected next=("<<links[nextLink].first<<","<<links[nextLink].second<<")"<<endl;
+            double left = uniformSample(threadSeed());
+            for(nextLink = st.linkBeg_; nextLink+1 < st.linkEnd_ && (left -= exp(lattice.getLinkProb(nextLink)-st.prob_)) > 0; nextLink++);
         }
         // otherwise follow the path
         else {
             pair<int,int> currPath = path.back(); path.pop_back();
-            for(nextLink = 0; nextLink < (int)links.size() && links[nextLink] != currPath; nextLink++) {
-                // cerr << "next=("<<links[nextLink].first<<","<<links[nextLink].second<<"), curr=("<<currPath.first<<","<<currPath.second<<")"<<endl;
-            }
-            if(nextLink == (int)links.size())
+            int target = lattice.findState(currPath.first,currPath.second);
+            for(nextLink = st.linkBeg_; nextLink < st.linkEnd_ && lattice.getLinkState(nextLink) != target; nextLink++);
+            if(target == -1 || nextLink == st.linkEnd_)
                 THROW_ERROR("Could not find path in lattice");
-            // cerr << "next=("<<links[nextLink].first<<","<<links[nextLink].second<<"), curr=("<<currPath.first<<","<<currPath.second<<") found!"<<endl;
         }
-        // set the boundary, save the probability, and get the next stack
-        if(links[nextLink].first != 0)
-            bounds[links[nextLink].first-1] = 1;
-        logProb += log(myTrans[nextLink]);
-        Stack::const_iterator it = stacks[links[nextLink].first].find(links[nextLink].second);
-        if(it == stacks[links[nextLink].first].end())
-            THROW_ERROR("Could not find selected value in stack");
-        currHyp = &(it->second);
-        // cerr << " b(b="<<links[nextLink].first<<",n="<<links[nextLink].second<<",p="<<log(myTrans[nextLink])<<")";
-        links = currHyp->links_;
+        // set the boundary, save the probability, and move to the previous state
+        curr = lattice.getLinkState(nextLink);
+        if(lattice.getState(curr).pos_ != 0)
+            bounds.set(beg+lattice.getState(curr).pos_-1, 1);
+        logProb += lattice.getLinkProb(nextLink)-st.prob_;
     }
-    // cerr << endl;
 
     // return the score
     return logProb;
 }
 
-// get a sample for the sentence
-pair<double,double> WSModel::sampleSentence(int sid, const WordSent & sent, Bounds & oldTags, Bounds & newTags) const {
+// walk the LM along a segmentation, summing the log probabilities of its words
+double WSModel::walkPath(const int* wids, const Bounds & bounds, PYLMNextCache * cache, vector<double> * slice, vector< pair<int,int> > * path) const {
+    int ss = bounds.size(), node = initNode_, next, beg = 0;
+    double logProb = 0;
+    if(slice)
+        slice->resize(ss+1);
+    if(path)
+        path->assign(ss+1, pair<int,int>(-1,-1));
+    for(int end = 1; end <= ss; end++) {
+        // the slice is drawn with density slice_*u^(slice_-1)/p^slice_ below
+        //  the probability p of the word ending here, or below 1 if none does
+        if(slice)
+            (*slice)[end] = log((randSample(threadSeed())+1.0)/(RAND_MAX+2.0))/slice_;
+        if(!bounds[end-1])
+            continue;
+        double myProb = log(memo_.getProb(lm_,node,wids[beg*maxLen_+end-beg-1],bases_[end-beg],next,cache));
+        if(slice)
+            (*slice)[end] += myProb;
+        if(path)
+            (*path)[beg] = pair<int,int>(node,end);
+        logProb += myProb;
+        node = next;
+        beg = end;
+    }
+    return logProb + log(memo_.getProb(lm_,node,initId_,getBase(initString_),next,cache));
+}
 
-    // cerr << "-------------- STARTING -----------------" <<endl;
+// add or remove words of a sentence, each with its n-gram context
+double WSModel::changeWords(const vector<int> & words, int beg, int end, bool add) {
+    double logProb = 0;
+    for(int k = 0; k < end-beg; k++) {
+        int i = (add ? beg+k : end-1-k), node = 0;
+        for(int j = i-1; i-j<n_ && j >= -1; j--)
+            node = lm_.getChild(node,(j==-1?initId_:words[j]),add,lm_.getStrength(i-j), lm_.getDisc(i-j));
+        double base = getBase(words[i]);
+        logProb += log(add ? lm_.addCust(node,words[i],base,threadSeed()) : lm_.removeCust(node,words[i],base,threadSeed()));
+    }
+    return logProb;
+}
+
+// change the segmentation of a sentence in the model. only the words
+//  between the first and last changed boundaries, and the n-1 words after
+//  them whose context changed, are removed and added
+void WSModel::replaceSentence(int sid, const WordSent & sent, const Bounds & oldLabs, const Bounds & newLabs) {
+    int first = oldLabs.firstDiff(newLabs);
+    if(first == -1) return;
+    if(!async_) memo_.clear();
+    static thread_local vector<int> oldWords, newWords;
+    makeWords(sent,oldLabs,false,oldWords);
+    makeWords(sent,newLabs,true,newWords);
+    // the words that end before the first change are the same, as are the
+    //  words after the one that ends after the last change, and the final
+    //  sentence end symbol
+    int last = oldLabs.lastDiff(newLabs);
+    int same = max(oldLabs.count()-oldLabs.count(last+1), 1);
+    int pre = oldLabs.count(first);
+    changeWords(oldWords, pre, min((int)oldWords.size(), (int)oldWords.size()-same+n_-1), false);
+    changeWords(newWords, pre, min((int)newWords.size(), (int)newWords.size()-same+n_-1), true);
+}
+
+// get the ID of the word from beg to end, from the candidates if possible
+int WSModel::getWordId(const WordSent & sent, const int* wids, int beg, int end) {
+    int wid = wids[beg*maxLen_+end-beg-1];
+    return (wid >= 0 ? wid : symbols_.getId(sent,beg,end-beg,true));
+}
+
+// split the word k of a sentence at mid, or join it from beg to end with the
+//  word after it
+void WSModel::setBoundary(const WordSent & sent, const int* wids, vector<int> & words, vector<int> & ends, int k, int beg, int mid, int end, bool split) {
+    if(split) {
+        words.insert(words.begin()+k+1, getWordId(sent, wids, mid, end));
+        ends.insert(ends.begin()+k, mid);
+        words[k] = getWordId(sent, wids, beg, mid);
+    } else {
+        words.erase(words.begin()+k+1);
+        ends.erase(ends.begin()+k);
+        words[k] = getWordId(sent, wids, beg, end);
+    }
+}
+
+// resample the boundaries of a sentence one at a time. for each boundary,
+//  the words on either side of it and the n-1 words that follow are removed,
+//  which gives the probability of the current choice, and the other choice
+//  is added in their place, which gives its probability. the return is the
+//  sum of the differences of the two for the choices that were changed
+double WSModel::samplePointwise(int sid, const WordSent & sent, Bounds & bounds, bool & changed) {
     int ss = sent.length();
+    const char* flags = (cons_ ? cons_->getFlags(sid) : 0);
+    static thread_local vector<int> scratch;
+    const int* wids = cands_.getWords(symbols_, sid, sent, scratch);
+    // the words of the sentence, and where each one ends
+    vector<int> words, ends;
+    for(int beg = 0, i; (i = bounds.next(beg)) < ss; beg = i+1) {
+        words.push_back(getWordId(sent, wids, beg, i+1));
+        ends.push_back(i+1);
+    }
+    words.push_back(initId_);
+    ends.push_back(ss+1);
+    changed = false;
+    double ret = 0;
+    for(int i = 0, k = 0; i < ss-1; i++) {
+        // find the word k that contains character i
+        while(ends[k] <= i) k++;
+        if(flags && flags[i] != WSConstraints::FREE)
+            continue;
+        int beg = (k ? ends[k-1] : 0), end = ends[bounds[i] ? k+1 : k];
+        if(end-beg > maxLen_)
+            continue;
+        int span = (bounds[i] ? 2 : 1), follow = min(n_-1, (int)words.size()-k-span);
+        double oldProb = changeWords(words, k, k+span+follow, false);
+        setBoundary(sent, wids, words, ends, k, beg, i+1, end, !bounds[i]);
+        double newProb = changeWords(words, k, k+3-span+follow, true);
+        // keep the new choice, or go back to the old one
+        if(bernoulliSample(1/(1+exp(oldProb-newProb)), threadSeed())) {
+            bounds.flip(i);
+            changed = true;
+            ret += newProb-oldProb;
+        } else {
+            changeWords(words, k, k+3-span+follow, false);
+            setBoundary(sent, wids, words, ends, k, beg, i+1, end, bounds[i]);
+            changeWords(words, k, k+span+follow, true);
+        }
+    }
+    return ret;
+}
+
+// build a lattice over the characters of a sentence from beg to end, starting
+//  at the LM state node. no word may end after beg up to noBeg, or from noEnd
+//  up to end. all states at end lead to one final state, through the words
+//  in after (with their base probabilities), such as the sentence end
+void WSModel::buildLattice(WSLattice & lattice, int sid, const int* wids, int beg, int end, int noBeg, int noEnd, const vector< pair<int,double> > & after, int node, const vector<double> * slice, const vector< pair<int,int> > * oldPath, PYLMNextCache * cache) const {
+
+    const char* flags = (cons_ ? cons_->getFlags(sid) : 0);
+    lattice.start(node);
 
-    vector< Stack > stacks (ss+2, Stack());
-    // 0.0 probability, terminal symbol 0, initial node
-    SegHyp initHyp(initNode_);
-    initHyp.prob_ = 0.0;
-    stacks[0].insert(Stack::value_type(initNode_,initHyp));
-
-    // do the forward step, build the segmentation lattice
-    for(int end = 1; end <= ss; end++) { // end of the string
-        Stack & next = stacks[end];
-        for(int beg = max(end-maxLen_,0); beg < end; beg++) { // beginning of the string
-            // get the substring and base probability
-            GenericString<int> nStr = sent.substr(beg,end-beg);
-            int wid = symbols_.getId(nStr);
-            double base = getBase(nStr);
-            // for all stacks in the history
-            for(Stack::iterator cit = stacks[beg].begin(); cit != stacks[beg].end(); cit++) {
-                double myProb = log(lm_.getProb(cit->second.node_,wid,base)); // get the prob for wid
-                int node = lm_.getNext(cit->second.node_,wid); // get the LM state after wid
-                Stack::iterator nit = next.find(node); // find the state in current stack
-                if(nit == next.end()) {
-                    next.insert(Stack::value_type(node,SegHyp(node))); // add a new node
-                    nit = next.find(node);
+    // do the forward step, build the segmentation lattice. with constraints,
+    //  no word ends where a boundary is forbidden or crosses a forced one
+    int minBeg = beg;
+    for(int e = beg+1; e <= end; e++) { // end of the string
+        lattice.openPosition();
+        if(flags && e > 1 && flags[e-2] == WSConstraints::SPLIT)
+            minBeg = e-1;
+        if((flags && flags[e-1] == WSConstraints::JOIN) || e <= noBeg || (e >= noEnd && e < end)) {
+            lattice.closePosition();
+            continue;
+        }
+        for(int b = max(e-maxLen_,minBeg); b < e; b++) { // beginning of the string
+            // get the word ID and base probability
+            int wid = wids[b*maxLen_+e-b-1];
+            double base = bases_[e-b];
+            // for all states in the history
+            for(int s = lattice.getPosBegin(b-beg); s < lattice.getPosEnd(b-beg); s++) {
+                int prevNode = lattice.getState(s).node_;
+                double prevProb = lattice.getState(s).prob_;
+                int node; // the LM state after wid
+                double myProb = log(memo_.getProb(lm_,prevNode,wid,base,node,cache)); // get the prob for wid
+                if(slice) {
+                    // the old path is always kept, even if the LM has changed
+                    //  since its slice was drawn
+                    if(myProb <= (*slice)[e] && ((*oldPath)[b].first != prevNode || (*oldPath)[b].second != e))
+                        continue;
+                    myProb *= 1-slice_;
                 }
-                // cerr << "middle links.push_back(n="<<node<<", w="<<wid<<", b="<<beg<<", e="<<end<<", pn="<<cit->second.node_<<", p="<<myProb<<"+"<<cit->second.prob_<<")"<<endl;
-                nit->second.links_.push_back(pair<int,int>(beg,cit->second.node_)); // add a back link
-                nit->second.linkProbs_.push_back(myProb + cit->second.prob_); // add the link's prob
+                lattice.addLink(node, s, myProb + prevProb); // add a back link
             }
         }
-        // sum the probabilities for the current stack
-        for(Stack::iterator nit = next.begin(); nit != next.end(); nit++)
-            nit->second.prob_ = addLogProbs(nit->second.linkProbs_);
-    }
-
-    // add transitions to the final stack
-    int end = ss+1, beg = ss;
-    double base = getBase(initString_);
-    Stack & next = stacks[end];
-    for(Stack::iterator cit = stacks[beg].begin(); cit != stacks[beg].end(); cit++) {
-        double myProb = log(lm_.getProb(cit->second.node_,initId_,base)); // get the prob for wid
-        Stack::iterator nit = next.find(0); // find the state in current stack
-        if(nit == next.end()) {
-            next.insert(Stack::value_type(0,SegHyp(0))); // add a new node
-            nit = next.find(0);
-        }
-        // cerr << "final links.push_back(n="<<0<<", w="<<initId_<<", b="<<beg<<", e="<<end<<", pn="<<cit->second.node_<<", p="<<myProb<<"+"<<cit->second.prob_<<")"<<endl;
-        nit->second.links_.push_back(pair<int,int>(beg,cit->second.node_)); // add a back link
-        nit->second.linkProbs_.push_back(myProb + cit->second.prob_); // add the link's prob
+        lattice.closePosition();
     }
+
+    // add transitions to the final position
+    lattice.openPosition();
+    for(int s = lattice.getPosBegin(end-beg); s < lattice.getPosEnd(end-beg); s++) {
+        int node = lattice.getState(s).node_;
+        double myProb = 0;
+        for(int k = 0; k < (int)after.size(); k++)
+            myProb += log(memo_.getProb(lm_,node,after[k].first,after[k].second,node,cache));
+        lattice.addLink(0, s, myProb + lattice.getState(s).prob_);
+    }
+    lattice.closePosition();
  
-    // sample backwards
-    // cerr << "-------------- STACKING -----------------" <<endl;
-    double probOld = backwardStep(sent,stacks,oldTags,false);
-    // cerr << "-------------- SAMPLING -----------------" <<endl;
-    double probNew = backwardStep(sent,stacks,newTags,true);
-    // cerr << "newTags =";
-    // for(int i = 0; i < (int)newTags.size(); i++)
-    //     cerr << " " << newTags[i];
-    // cerr << endl;
+}
+
+// get a sample for the sentence
+pair<double,double> WSModel::sampleSentence(int sid, const WordSent & sent, Bounds & oldTags, Bounds & newTags) const {
+
+    int ss = sent.length();
+    timeval tStart, tEnd;
+    gettimeofday(&tStart, NULL);
+
+    // each thread keeps its own lattice, so memory is reused across sentences
+    static thread_local WSLattice lattice;
+
+    // get the IDs of all candidate words in the sentence
+    static thread_local vector<int> scratch;
+    const int* wids = cands_.getWords(symbols_, sid, sent, scratch);
+
+    // the LM state transitions seen by this thread, kept across sentences,
+    //  which can't be checked while other threads are changing the LM
+    static thread_local PYLMNextCache nextCache;
+    PYLMNextCache * myCache = (async_ ? 0 : &nextCache);
+
+    // the sentence end, which follows the last word of a path
+    static thread_local vector< pair<int,double> > after;
+    after.assign(1, pair<int,double>(initId_, getBase(initString_)));
+
+    // when slice sampling, draw the slice variables from the old path. links
+    //  that fall below the slice at their end are pruned, and the others are
+    //  weighted by prob^(1-slice_), which makes the lattice sample from the
+    //  model augmented with the slice variables. the proposal is then scored
+    //  by the full probabilities of the paths
+    static thread_local vector< pair<int,int> > oldPath;
+    if(slice_ > 0) {
+        static thread_local vector<double> slice;
+        double probOld = walkPath(wids, oldTags, myCache, &slice, &oldPath);
+        buildLattice(lattice, sid, wids, 0, ss, 0, ss, after, initNode_, &slice, &oldPath, myCache);
+        backwardStep(wids, lattice, newTags, 0, initNode_, true);
+        double probNew = walkPath(wids, newTags, myCache, 0, 0);
+        gettimeofday(&tEnd, NULL);
+        latStats_.add(lattice.getStateCount(), ss+1, (tEnd.tv_sec-tStart.tv_sec)*1000000LL+(tEnd.tv_usec-tStart.tv_usec), lattice.getMemoryUsage());
+        return pair<double,double>(probOld,probNew);
+    }
+
+    if(chunk_ <= 0 || ss <= chunk_) {
+        buildLattice(lattice, sid, wids, 0, ss, 0, ss, after, initNode_, 0, 0, myCache);
+        double probOld = backwardStep(wids, lattice, oldTags, 0, initNode_, false);
+        double probNew = backwardStep(wids, lattice, newTags, 0, initNode_, true);
+        gettimeofday(&tEnd, NULL);
+        latStats_.add(lattice.getStateCount(), ss+1, (tEnd.tv_sec-tStart.tv_sec)*1000000LL+(tEnd.tv_usec-tStart.tv_usec), lattice.getMemoryUsage());
+        return pair<double,double>(probOld,probNew);
+    }
+
+    // long sentences are sampled in overlapping windows, each a Gibbs step
+    //  for its part of the path. window w has a target t every chunk_
+    //  characters from a random offset (the last one at the sentence end),
+    //  and p, maxLen_ characters before the previous target. it runs from
+    //  the last boundary b at or before p to the first e at or after t, and
+    //  no word may end in (b,p] or [t,e), so the old and new paths give the
+    //  same window. it starts from the LM state of the current path at b,
+    //  and its end states are scored through the following n_-1 words of the
+    //  current path. the windows are visited in a random direction, which
+    //  makes the whole proposal reversible, so it is scored like the slice
+    //  sampler, by the full probabilities of the paths
+    static thread_local vector<int> lefts, rights;
+    lefts.clear(); rights.clear();
+    for(int t = randSample(threadSeed()) % chunk_ + chunk_; ; t += chunk_) {
+        lefts.push_back(rights.size() ? max(rights.back()-maxLen_, 0) : 0);
+        rights.push_back(min(t, ss));
+        if(t >= ss) break;
+    }
+    double probOld = walkPath(wids, oldTags, myCache, 0, &oldPath);
+    newTags = oldTags;
+    bool forward = randSample(threadSeed()) % 2;
+    int windows = lefts.size(), states = 0;
+    size_t memory = 0;
+    for(int i = 0; i < windows; i++) {
+        int w = (forward ? i : windows-1-i), t = rights[w], b, e;
+        for(b = lefts[w]; b > 0 && !newTags[b-1]; b--);
+        e = (t == ss ? ss : newTags.next(t-1)+1);
+        // the words after the window, and the sentence end if it is near
+        after.clear();
+        int j = e;
+        for(int k = 0; k < n_-1 && j < ss; k++) {
+            int f = newTags.next(j)+1;
+            after.push_back(pair<int,double>(wids[j*maxLen_+f-j-1], bases_[f-j]));
+            j = f;
+        }
+        if((int)after.size() < n_-1)
+            after.push_back(pair<int,double>(initId_, getBase(initString_)));
+        int node = oldPath[b].first;
+        buildLattice(lattice, sid, wids, b, e, lefts[w], t, after, node, 0, 0, myCache);
+        backwardStep(wids, lattice, newTags, b, node, true);
+        states += lattice.getStateCount();
+        memory = max(memory, lattice.getMemoryUsage());
+        // keep the LM states of the new path for the next window
+        if(forward) {
+            for(j = b; j < e; ) {
+                int f = newTags.next(j)+1, wid = wids[j*maxLen_+f-j-1];
+                oldPath[j] = pair<int,int>(node, f);
+                node = (myCache ? lm_.getNext(node, wid, *myCache) : lm_.getNext(node, wid));
+                j = f;
+            }
+        }
+    }
+    double probNew = walkPath(wids, newTags, myCache, 0, 0);
+
+    gettimeofday(&tEnd, NULL);
+    latStats_.add(states, ss+1, (tEnd.tv_sec-tStart.tv_sec)*1000000LL+(tEnd.tv_usec-tStart.tv_usec), memory);
     
     return pair<double,double>(probOld,probNew);
 
 }
 
+// give a word of the trained model the next frozen ID if it has none
+static int freezeWord(vector<int> & newIds, vector<int> & oldIds, int wid) {
+    if((int)newIds.size() <= wid) newIds.resize(wid+1, -1);
+    if(newIds[wid] == -1) {
+        newIds[wid] = oldIds.size();
+        oldIds.push_back(wid);
+    }
+    return newIds[wid];
+}
+
+void WSModel::freeze(const CorpusBase<WordSent> & corp, const string & fileName) const {
+    WSFrozenData data;
+    data.n_ = n_;
+    data.maxLen_ = maxLen_;
+    data.bases_ = bases_;
+    for(int i = 0; i < chars_; i++)
+        data.chars_.push_back(corp.getSymbol(i));
+    // the words with customers, which are all of the live words
+    vector<int> newIds, oldIds, wids;
+    data.initId_ = freezeWord(newIds, oldIds, initId_);
+    lm_.getWords(0, wids);
+    for(int i = 0; i < (int)wids.size(); i++)
+        freezeWord(newIds, oldIds, wids[i]);
+    // the nodes in breadth-first order, and the entries of each one, where
+    //  the words with customers and the children are both sorted by ID
+    vector<int> order(1, 0), nodeIds(1, 0);
+    data.initNode_ = 0;
+    for(int i = 0; i < (int)order.size(); i++) {
+        int node = order[i];
+        if(node == initNode_) data.initNode_ = i;
+        data.parents_.push_back(i == 0 ? -1 : nodeIds[lm_.getParent(node)]);
+        data.contexts_.push_back(i == 0 ? -1 : freezeWord(newIds, oldIds, lm_.getContextWord(node)));
+        data.fallbacks_.push_back(lm_.getFallbackProb(node));
+        wids.clear();
+        lm_.getWords(node, wids);
+        sort(wids.begin(), wids.end());
+        const gng::SmallVector<PYLMChild,2> & children = lm_.getChildren(node);
+        int j = 0, k = 0;
+        while(j < (int)wids.size() || k < (int)children.size()) {
+            WSFrozenData::Entry entry = { i, -1, -1, -1 };
+            int wid = (j < (int)wids.size() ? wids[j] : INT_MAX);
+            if(k < (int)children.size() && children[k].wid_ <= wid) {
+                wid = children[k].wid_;
+                if((int)nodeIds.size() <= children[k].node_) nodeIds.resize(children[k].node_+1, -1);
+                nodeIds[children[k].node_] = order.size();
+                order.push_back(children[k].node_);
+                entry.child_ = nodeIds[children[k].node_];
+                k++;
+            }
+            if(j < (int)wids.size() && wids[j] == wid) {
+                entry.prob_ = lm_.getProb(node, wid, getBase(wid));
+                j++;
+            }
+            entry.wid_ = freezeWord(newIds, oldIds, wid);
+            data.entries_.push_back(entry);
+        }
+    }
+    for(int i = 0; i < (int)oldIds.size(); i++) {
+        const GenericString<int> & str = symbols_.getSymbol(oldIds[i]);
+        data.words_.push_back(vector<int>(str.length()));
+        for(int j = 0; j < (int)str.length(); j++)
+            data.words_.back()[j] = str[j];
+    }
+    WSFrozenModel::write(data, fileName);
+    cerr << "Froze "<<oldIds.size()<<" words, "<<order.size()<<" nodes and "<<data.entries_.size()<<" entries to "<<fileName<<endl;
+}
 
 void WSModel::initialize(CorpusBase<WordSent> & corp, LabelsBase<WordSent,Bounds> & labs, bool add) {
     initString_ = GenericString<int>(0);
     initId_ = symbols_.getId(initString_,true);
     initNode_ = (lm_.getN()==1?0:lm_.getChild(0,initId_,true,lm_.getStrength(0),lm_.getDisc(0)));
+    cands_.initialize(corp, maxLen_, (size_t)conf_.getInt("candmem") << 20);
     ModelBase<WordSent,Bounds>::initialize(corp,labs,add);
 }
@@ -1,7 +1,10 @@
 
 #include <iostream>
+#include <unistd.h>
+#include <set>
 #include "pgibbs/model-hmm.h"
 #include "pgibbs/model-ws.h"
+#include "pgibbs/segmenter-ws.h"
 
 using namespace std;
 using namespace pgibbs;
@@ -15,7 +18,7 @@ int testWSSample() {
     WordCorpus corp; corp.push_back(ws);
  
     // make a corpus with one one-word sentence
-    Bounds cs(2); cs[0]=0; cs[1]=1;
+    Bounds cs(2); cs.set(0,0); cs.set(1,1);
     WSLabels labs; labs.push_back(cs);
     
     // make the value
@@ -94,13 +97,1033 @@ int testHMMSample() {
 
 }
 
+int testHMMAsync() {
+
+    // train a small HMM with four threads sampling asynchronously, and make
+    //  sure the shared transitions were refreshed once every three
+    //  sentences, that their drift was recorded, and that the model is
+    //  empty after removing every sentence
+    srand(31);
+    ostringstream text;
+    for(int i = 0; i < 40; i++) {
+        for(int j = rand() % 10; j >= 0; j--)
+            text << (char)('a'+rand()%5) << (j ? " " : "\n");
+    }
+    istringstream in(text.str());
+    WordCorpus corp;
+    corp.load(in, true);
+    ostringstream prefix; prefix << "/tmp/pgibbs-test-hmm." << getpid();
+    string prefixStr = prefix.str();
+    const char* argv[] = { "test-pgibbs", "-sampmeth", "async", "-threads", "4",
+        "-refresh", "3", "-iters", "3", "-classes", "3", "-randseed", "123",
+        "unused", prefixStr.c_str() };
+    HMMConfig conf;
+    conf.loadConfig(sizeof(argv)/sizeof(argv[0]), (char**)argv);
+    conf.addConfigEntry("words", "0", "");
+    conf.setInt("words",corp.getVocabSize());
+    HMMLabels labs;
+    labs.initRandom(corp, conf);
+    HMMModel hmmMod(conf);
+    hmmMod.train(corp, labs);
+    for(int iter = 1; iter <= 3; iter++) {
+        ostringstream labName; labName << prefixStr << "." << iter << ".lab";
+        unlink(labName.str().c_str());
+    }
+    int ret = 1;
+    if(hmmMod.getRefreshes() != (int)corp.size()/3 || hmmMod.getDriftSum() <= 0
+            || hmmMod.getDriftMax() <= 0 || hmmMod.getDriftMax() > hmmMod.getDriftSum()+1e-12) {
+        cout << "HMM async refreshes="<<hmmMod.getRefreshes()<<" (expected "<<corp.size()/3
+             <<"), drift sum="<<hmmMod.getDriftSum()<<", max="<<hmmMod.getDriftMax()<<endl;
+        ret = 0;
+    }
+    try {
+        hmmMod.clear(corp,labs);
+    } catch(std::exception & e) {
+        cout << e.what() << endl;
+        ret = 0;
+    }
+    cout << "HMM async sampling kept the model consistent: "<<ret<<endl;
+    return ret;
+
+}
+
+int checkAdaptiveIndex(PyAdaptiveIndex<> & adapt, PySparseIndex<> & sparse, int maxId) {
+    for(int id = -1; id < maxId; id++) {
+        if(adapt.getTotal(id) != sparse.getTotal(id)) {
+            cout << "Adaptive index mismatch at "<<id<<": "<<adapt.getTotal(id)<<" != "<<sparse.getTotal(id)<<endl;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int testAdaptiveIndex() {
+
+    // add and remove random IDs from both an adaptive and a sparse index,
+    //  first sparsely, then densely enough to cause promotion, then over a
+    //  range wide enough that the dense array would be mostly empty
+    PyAdaptiveIndex<> adapt;
+    PySparseIndex<> sparse;
+    srand(123);
+    int range[3] = { 50000, 20000, 2000000 }, ret = 1;
+    // nothing is allocated until the first ID is added
+    if(adapt.getMemoryUsage() != 0 || adapt.getTableSet(5) != 0) ret = 0;
+    for(int phase = 0; phase < 3; phase++) {
+        for(int i = 0; i < 30000; i++) {
+            int id = rand() % range[phase];
+            if(rand() % 3 == 0) {
+                // remove customers in the same way as PyDist::remove
+                if(sparse.getTotal(id) == 0) continue;
+                if(--adapt.addTableSet(id).total == 0) adapt.removeTableSet(id);
+                if(--sparse.addTableSet(id).total == 0) sparse.removeTableSet(id);
+            } else {
+                adapt.addTableSet(id).total++;
+                sparse.addTableSet(id).total++;
+            }
+        }
+        ret &= checkAdaptiveIndex(adapt, sparse, range[phase]);
+        ret &= (adapt.isDense() == (phase == 1));
+    }
+    cout << "Adaptive index matched sparse index: "<<ret<<endl;
+    return ret;
+
+}
+
+// add and remove customers and return the average number of tables
+template < class Dist >
+double averageTables(Dist & dist, int iters) {
+    double tables = 0;
+    for(int i = 0; i < iters; i++) {
+        for(int j = 0; j < 40; j++)
+            dist.add(j % 3, 0.1);
+        for(int j = 0; j < 20; j++)
+            dist.remove(j % 3, 0.1);
+        tables += dist.getTableCount();
+        for(int j = 20; j < 40; j++)
+            dist.remove(j % 3, 0.1);
+    }
+    return tables/iters;
+}
+
+int testHistTableSet() {
+
+    // the histogram seating should give the same distribution over tables
+    int iters = 20000;
+    srand(123);
+    PyDist<PySparseIndex> listDist(1.0, 0.5);
+    double listTables = averageTables(listDist, iters);
+    PyDist<PySparseIndex,PyHistTableSet> histDist(1.0, 0.5);
+    double histTables = averageTables(histDist, iters);
+    cout << "Average tables for list: "<<listTables<<", histogram: "<<histTables<<endl;
+    return fabs(listTables-histTables) < 0.1 && listDist.isEmpty() && histDist.isEmpty();
+
+}
+
+// the original one-bernoulli-at-a-time auxiliary variable sampler
+template < class Dist >
+pair<double,double> referenceParameters(vector<Dist*> & dists, double sa, double sb, double da, double db) {
+    double stren = dists[0]->getStrength(), disc = dists[0]->getDiscount();
+    for(int i = 0; i < (int)dists.size(); i++) {
+        if(dists[i]->getTableCount() > 1) {
+            for(int j = 1; j < dists[i]->getTableCount(); j++) {
+                int yui = bernoulliSample(stren/(stren+disc*j));
+                da += (1-yui);
+                sa += yui;
+            }
+            sb -= log(betaSample(stren+1,dists[i]->getCustomerCount()-1));
+        }
+        const gng::SmallVector<PyTableCount,2> & sizes = dists[i]->getTableSizeCounts();
+        for(int s = 0; s < (int)sizes.size(); s++)
+            for(int j = 1; j < sizes[s].size; j++)
+                for(int k = 0; k < sizes[s].count; k++)
+                    db += (1-bernoulliSample((j-1)/(j-disc)));
+    }
+    return pair<double,double>(gammaSample(sa,1/sb), betaSample(da,db));
+}
+
+int testSampleParameters() {
+
+    // seat customers in a few distributions with tied parameters
+    srand(321);
+    typedef PyDist<PyAdaptiveIndex,PyHistTableSet> Dist;
+    vector<Dist*> dists;
+    for(int i = 0; i < 20; i++) {
+        dists.push_back(new Dist(1.0, 0.5));
+        for(int j = 0; j < 30*(i+1); j++)
+            dists[i]->add(rand() % (i+5), 0.01);
+    }
+    // and many small ones, so the same customer counts are shared by many
+    //  distributions
+    for(int i = 0; i < 40; i++) {
+        dists.push_back(new Dist(1.0, 0.5));
+        for(int j = 0; j < 3+i%3; j++)
+            dists.back()->add(rand() % 3, 0.01);
+    }
+    // the mean and variance of strength and discount over many draws should
+    //  be the same for the binomial sampler and the reference sampler, with
+    //  one or several threads
+    int iters = 4000;
+    unsigned seed = 99;
+    vector<double> sums(8, 0.0);
+    for(int i = 0; i < iters; i++) {
+        for(int j = 0; j < (int)dists.size(); j++) {
+            dists[j]->setStrength(1.0); dists[j]->setDiscount(0.5);
+        }
+        pair<double,double> ref = referenceParameters(dists,1,1,1,1);
+        pair<double,double> bin = Dist::sampleParameters(dists,1,1,1,1,(i%2 ? 3 : 1),&seed);
+        double vals[4] = { ref.first, bin.first, ref.second, bin.second };
+        for(int k = 0; k < 4; k++) {
+            sums[k] += vals[k];
+            sums[k+4] += vals[k]*vals[k];
+        }
+    }
+    int ret = 1;
+    for(int k = 0; k < 4; k += 2) {
+        double m1 = sums[k]/iters, m2 = sums[k+1]/iters;
+        double v1 = sums[k+4]/iters-m1*m1, v2 = sums[k+5]/iters-m2*m2;
+        double z = (m1-m2)/sqrt((v1+v2)/iters);
+        cout << (k ? "Discount" : "Strength") << " reference="<<m1<<" ("<<v1<<"), binomial="<<m2<<" ("<<v2<<"), z="<<z<<endl;
+        if(fabs(z) > 4 || fabs(v1-v2) > 0.2*v1)
+            ret = 0;
+    }
+    // the size histograms only hold sizes with tables, in order
+    for(int i = 0; i < (int)dists.size(); i++) {
+        const gng::SmallVector<PyTableCount,2> & sizes = dists[i]->getTableSizeCounts();
+        for(int s = 0; s < (int)sizes.size(); s++)
+            if(sizes[s].count <= 0 || sizes[s].size < 2 || (s && sizes[s].size <= sizes[s-1].size))
+                ret = 0;
+    }
+    for(int i = 0; i < (int)dists.size(); i++)
+        delete dists[i];
+    return ret;
+
+}
+
+int testWSVocab() {
+
+    // add and remove random short words, and make sure that the trie and
+    //  the candidate cache find the same IDs as looking up every substring
+    srand(42);
+    WSVocab vocab;
+    vector<int> ids, scratch;
+    int ret = 1, maxLen = 4;
+    CorpusBase<WordSent> corp;
+    for(int i = 0; i < 4; i++) {
+        corp.push_back(WordSent(10));
+        for(int j = 0; j < 10; j++)
+            corp[i][j] = rand() % 3;
+    }
+    WSCandidateCache cache;
+    cache.initialize(corp, maxLen, 1 << 20);
+    for(int iter = 0; iter < 2000 && ret; iter++) {
+        if(ids.size() && rand() % 3 == 0) {
+            int pos = rand() % ids.size();
+            vocab.removeId(ids[pos]);
+            ids.erase(ids.begin()+pos);
+        } else {
+            WordSent word(rand() % maxLen + 1);
+            for(int i = 0; i < (int)word.length(); i++)
+                word[i] = rand() % 3;
+            int size = vocab.size(), id = vocab.getId(word, true);
+            if((int)vocab.size() != size)
+                ids.push_back(id);
+        }
+        WordSent sent(8);
+        for(int i = 0; i < 8; i++)
+            sent[i] = rand() % 3;
+        vector<int> wids(maxLen);
+        for(int beg = 0; beg < 8; beg++) {
+            vocab.findWords(sent, beg, maxLen, &wids[0]);
+            for(int len = 1; len <= maxLen; len++) {
+                int exp = (beg+len <= 8 ? vocab.getId(sent.substr(beg,len)) : -1);
+                if(wids[len-1] != exp) {
+                    cout << "findWords("<<beg<<","<<len<<") == "<<wids[len-1]<<" != "<<exp<<endl;
+                    ret = 0;
+                }
+                if(beg+len <= 8 && vocab.getId(sent,beg,len,false) != exp) {
+                    cout << "getId(sent,"<<beg<<","<<len<<") == "<<vocab.getId(sent,beg,len,false)<<" != "<<exp<<endl;
+                    ret = 0;
+                }
+            }
+        }
+        int sid = rand() % corp.size();
+        const int* cands = cache.getWords(vocab, sid, corp[sid], scratch);
+        for(int beg = 0; beg < 10; beg++) {
+            vocab.findWords(corp[sid], beg, maxLen, &wids[0]);
+            if(!equal(wids.begin(), wids.end(), cands+beg*maxLen)) {
+                cout << "Cached candidates differ for sentence "<<sid<<" at "<<beg<<endl;
+                ret = 0;
+            }
+        }
+    }
+    for(int i = 0; i < (int)ids.size(); i++)
+        vocab.removeId(ids[i]);
+    if(vocab.getTrieSize() != 1) {
+        cout << "Trie has "<<vocab.getTrieSize()<<" nodes after removing all words"<<endl;
+        ret = 0;
+    }
+    cout << "WS vocabulary trie matched symbols: "<<ret<<endl;
+    return ret;
+
+}
+
+int testWSConstraints() {
+
+    // make sure that both the random initialization and the samples keep
+    //  the known boundaries, and never make words longer than maxlen
+    srand(42);
+    WordCorpus corp;
+    for(int i = 0; i < 3; i++) {
+        corp.push_back(WordSent(8));
+        for(int j = 0; j < 8; j++)
+            corp[i][j] = (i+j) % 3;
+    }
+    istringstream in("- 0 0 - 1 - - 1\n\n0 0 - - 0 - 1 -\n");
+    WSConfig conf;
+    conf.addConfigEntry("chars", "3", "");
+    conf.setInt("maxlen",3);
+    conf.setInt("randseed",123);
+    WSConstraints cons;
+    cons.load(in, corp, 3);
+    WSLabels labs;
+    labs.initRandom(corp, conf, &cons);
+    WSModel wsMod(conf);
+    wsMod.setConstraints(&cons);
+    wsMod.initialize(corp,labs,true);
+    int ret = 1;
+    for(int iter = 0; iter < 200 && ret; iter++) {
+        for(int i = 0; i < (int)corp.size() && ret; i++) {
+            const char* flags = cons.getFlags(i);
+            int last = -1;
+            for(int j = 0; j < (int)labs[i].size(); j++) {
+                if(flags && ((flags[j] == WSConstraints::SPLIT && !labs[i][j]) || (flags[j] == WSConstraints::JOIN && labs[i][j]))) {
+                    cout << "Sentence "<<i<<" broke the constraint at "<<j<<" in iteration "<<iter<<endl;
+                    ret = 0;
+                }
+                if(labs[i][j]) {
+                    if(j-last > 3) {
+                        cout << "Sentence "<<i<<" has a word of length "<<j-last<<" in iteration "<<iter<<endl;
+                        ret = 0;
+                    }
+                    last = j;
+                }
+            }
+            Bounds old = labs[i];
+            wsMod.removeSentence(i,corp[i],old);
+            wsMod.sampleSentence(i,corp[i],old,labs[i]);
+            wsMod.addSentence(i,corp[i],labs[i]);
+        }
+    }
+    cout << "WS constraints were kept: "<<ret<<endl;
+    return ret;
+
+}
+
+// make sents random sentences of 1 to sentLen characters from the first
+//  chars letters, segment them at random, and add them to a new model of
+//  n-grams over words of up to maxLen characters. any other options for
+//  the model should be set in conf beforehand
+WSModel * makeRandomWSModel(int seed, int sents, int sentLen, int chars, int maxLen, int n, WSConfig & conf, WordCorpus & corp, WSLabels & labs) {
+    srand(seed);
+    ostringstream text;
+    for(int i = 0; i < sents; i++) {
+        for(int j = rand() % sentLen; j >= 0; j--)
+            text << (char)('a'+rand()%chars) << (j ? " " : "\n");
+    }
+    istringstream in(text.str());
+    corp.load(in);
+    conf.addConfigEntry("chars", "0", "");
+    conf.setInt("chars",chars);
+    conf.setInt("maxlen",maxLen);
+    conf.setInt("n",n);
+    conf.setInt("randseed",123);
+    labs.initRandom(corp, conf);
+    WSModel * wsMod = new WSModel(conf);
+    wsMod->initialize(corp,labs,true);
+    return wsMod;
+}
+
+// make a new empty file in /tmp and return its name
+string makeTempFile(const string & prefix) {
+    string name = "/tmp/"+prefix+".XXXXXX";
+    vector<char> buf(name.begin(), name.end());
+    buf.push_back(0);
+    int fd = mkstemp(&buf[0]);
+    if(fd == -1)
+        THROW_ERROR("Could not make a temporary file "<<name);
+    close(fd);
+    return string(&buf[0]);
+}
+
+int testWSPointwise() {
+
+    // resample random sentences pointwise, and make sure that the words
+    //  stay short enough and the LM is empty after removing them all
+    WSConfig conf;
+    WordCorpus corp;
+    WSLabels labs;
+    WSModel * wsMod = makeRandomWSModel(42, 20, 10, 3, 3, 3, conf, corp, labs);
+    int ret = 1, changed = 0;
+    for(int iter = 0; iter < 50 && ret; iter++) {
+        for(int i = 0; i < (int)corp.size() && ret; i++) {
+            // the log probability only changes with the labels
+            bool sentChanged;
+            double diff = wsMod->samplePointwise(i,corp[i],labs[i],sentChanged);
+            changed += sentChanged;
+            if(!sentChanged && diff != 0) {
+                cout << "Sentence "<<i<<" changed log probability by "<<diff<<" without changing"<<endl;
+                ret = 0;
+            }
+            int last = -1;
+            for(int j = 0; j < (int)labs[i].size(); j++) {
+                if(labs[i][j]) {
+                    if(j-last > 3) {
+                        cout << "Sentence "<<i<<" has a word of length "<<j-last<<" in iteration "<<iter<<endl;
+                        ret = 0;
+                    }
+                    last = j;
+                }
+            }
+            if(last != (int)labs[i].size()-1) {
+                cout << "Sentence "<<i<<" lost its final boundary in iteration "<<iter<<endl;
+                ret = 0;
+            }
+        }
+    }
+    try {
+        wsMod->clear(corp,labs);
+    } catch(std::exception & e) {
+        cout << e.what() << endl;
+        ret = 0;
+    }
+    if(changed == 0) {
+        cout << "No boundaries changed in pointwise sampling"<<endl;
+        ret = 0;
+    }
+    delete wsMod;
+    cout << "WS pointwise sampling kept the model consistent: "<<ret<<endl;
+    return ret;
+
+}
+
+// resample the first sentence of len characters in a small fixed corpus with
+//  metropolis-hastings steps, keeping the others in the model, and return how
+//  often each segmentation of it was kept
+vector<double> sampleFrequencies(double slice, int chunk, int n, int len, int samps) {
+    WSConfig conf;
+    conf.setDouble("str",10.0);
+    conf.setDouble("slice",slice);
+    conf.setInt("chunk",chunk);
+    WordCorpus corp;
+    WSLabels labs;
+    WSModel * wsMod = makeRandomWSModel(11, 30, 8, 3, 3, n, conf, corp, labs);
+    int s = 0;
+    while(s+1 < (int)corp.size() && corp[s].length() != len) s++;
+    vector<double> freqs(1 << (len-1), 0);
+    if(corp[s].length() != len) {
+        cout << "No sentence of length "<<len<<endl;
+        delete wsMod;
+        return freqs;
+    }
+    for(int i = 0; i < samps; i++) {
+        Bounds old = labs[s];
+        double trueOld = wsMod->removeSentence(s,corp[s],old);
+        wsMod->cacheProbabilities();
+        pair<double,double> prop = wsMod->sampleSentence(s,corp[s],old,labs[s]);
+        double trueNew = wsMod->addSentence(s,corp[s],labs[s]);
+        if(!bernoulliSample(min(1.0, exp(trueNew-trueOld+prop.first-prop.second)))) {
+            wsMod->removeSentence(s,corp[s],labs[s]);
+            labs[s] = old;
+            wsMod->addSentence(s,corp[s],labs[s]);
+        }
+        int seg = 0;
+        for(int j = 0; j < len-1; j++)
+            seg |= labs[s][j] << j;
+        freqs[seg] += 1.0/samps;
+    }
+    delete wsMod;
+    return freqs;
+}
+
+int testWSChunk() {
+
+    // sample long sentences in short windows through the usual sampling
+    //  pass, and make sure the old path is always found in the windows
+    WSConfig conf;
+    conf.setInt("chunk",5);
+    WordCorpus corp;
+    WSLabels labs;
+    WSModel * wsMod = makeRandomWSModel(42, 10, 60, 3, 4, 2, conf, corp, labs);
+    int ret = 1, accepted = 0, total = 0;
+    for(int iter = 0; iter < 20 && ret; iter++) {
+        for(int i = 0; i < (int)corp.size() && ret; i++) {
+            Bounds old = labs[i];
+            double trueOld = wsMod->removeSentence(i,corp[i],old);
+            wsMod->cacheProbabilities();
+            pair<double,double> prop = wsMod->sampleSentence(i,corp[i],old,labs[i]);
+            double trueNew = wsMod->addSentence(i,corp[i],labs[i]);
+            if(prop.first != prop.first || prop.first == NEG_INFINITY || prop.second == NEG_INFINITY) {
+                cout << "Bad proposal probabilities "<<prop.first<<", "<<prop.second<<" in iteration "<<iter<<endl;
+                ret = 0;
+            }
+            total++;
+            if(bernoulliSample(min(1.0, exp(trueNew-trueOld+prop.first-prop.second)))) {
+                accepted++;
+            } else {
+                wsMod->removeSentence(i,corp[i],labs[i]);
+                labs[i] = old;
+                wsMod->addSentence(i,corp[i],labs[i]);
+            }
+        }
+    }
+    if(accepted == 0) {
+        cout << "No chunked samples were accepted"<<endl;
+        ret = 0;
+    }
+    delete wsMod;
+    cout << "WS chunked sampling accepted "<<accepted<<"/"<<total<<": "<<ret<<endl;
+    // the windows are exact Gibbs steps, so the kept segmentations must
+    //  follow the same distribution as when sampling the whole sentence, even
+    //  when the LM context reaches past the window
+    int samps = 100000;
+    for(int n = 2; n <= 3; n++) {
+        vector<double> full = sampleFrequencies(0, 0, n, 7, samps);
+        vector<double> freqs = sampleFrequencies(0, 2, n, 7, samps);
+        double dist = 0;
+        for(int i = 0; i < (int)full.size(); i++)
+            dist += fabs(freqs[i]-full[i])/2;
+        cout << "WS chunk n="<<n<<" total variation from the full lattice: "<<dist<<endl;
+        if(dist > 0.02)
+            ret = 0;
+    }
+    return ret;
+
+}
+
+int testWSBounds() {
+
+    // check the packed boundaries against a vector of bools, with sizes on
+    //  both sides of the 64-bit words
+    srand(42);
+    int ret = 1;
+    for(int t = 0; t < 200 && ret; t++) {
+        int size = rand() % 200 + 1;
+        vector<bool> a(size), b(size);
+        Bounds ba(size), bb(size);
+        for(int i = 0; i < size; i++) {
+            a[i] = rand() % 4 == 0; ba.set(i, a[i]);
+            b[i] = (t % 2 ? a[i] : rand() % 4 == 0); bb.set(i, b[i]);
+        }
+        int beg = rand() % size, end = beg + rand() % (size-beg+1);
+        for(int i = beg; i < end; i++) { a[i] = 0; b[i] = b[i] && t % 2; }
+        ba.clear(beg, end);
+        if(t % 2 == 0) bb.clear(beg, end);
+        int first = -1, last = -1, count = 0;
+        for(int i = 0; i < size; i++) {
+            if(ba[i] != a[i]) {
+                cout << "Bounds["<<i<<"] == "<<ba[i]<<" != "<<a[i]<<" (size "<<size<<")"<<endl;
+                ret = 0;
+            }
+            int next = i;
+            while(next < size && !a[next]) next++;
+            if(ba.next(i) != next || ba.count(i) != count) {
+                cout << "Bounds.next("<<i<<") == "<<ba.next(i)<<" != "<<next<<" or count == "<<ba.count(i)<<" != "<<count<<endl;
+                ret = 0;
+            }
+            count += a[i];
+            if(a[i] != b[i]) {
+                if(first == -1) first = i;
+                last = i;
+            }
+        }
+        if(ba.firstDiff(bb) != first || ba.lastDiff(bb) != last || (ba == bb) != (first == -1)) {
+            cout << "Bounds diff == ("<<ba.firstDiff(bb)<<","<<ba.lastDiff(bb)<<") != ("<<first<<","<<last<<")"<<endl;
+            ret = 0;
+        }
+    }
+
+    // replace segmentations in the model with others that share some of
+    //  their words, and make sure the LM is empty after removing the new ones
+    WSConfig conf;
+    WordCorpus corp;
+    WSLabels labs, others;
+    WSModel * wsMod = makeRandomWSModel(43, 20, 150, 3, 4, 3, conf, corp, labs);
+    others.initRandom(corp, conf);
+    for(int i = 0; i < (int)corp.size(); i++) {
+        // keep the old words at the start and end of some sentences
+        Bounds bs = others[i];
+        int len = corp[i].length(), beg = rand() % len, end = beg + rand() % (len-beg);
+        for(int j = 0; j < len; j++)
+            if(j < beg || j >= end)
+                bs.set(j, labs[i][j]);
+        for(int j = 0, last = -1; j < len; j++) {
+            if(j-last >= 4) bs.set(j, 1);
+            if(bs[j]) last = j;
+        }
+        wsMod->replaceSentence(i,corp[i],labs[i],bs);
+        labs[i] = bs;
+    }
+    try {
+        wsMod->clear(corp,labs);
+    } catch(std::exception & e) {
+        cout << e.what() << endl;
+        ret = 0;
+    }
+    delete wsMod;
+    cout << "WS packed boundaries and replacement: "<<ret<<endl;
+    return ret;
+
+}
+
+int testWSFrozen() {
+
+    // freeze a trained model and make sure the mapped copy gives the same
+    //  word IDs, contexts and probabilities when walking each sentence
+    WSConfig conf;
+    WordCorpus corp;
+    WSLabels labs;
+    WSModel * wsMod = makeRandomWSModel(17, 50, 20, 4, 4, 3, conf, corp, labs);
+    string fileName = makeTempFile("pgibbs-test-frz");
+    wsMod->freeze(corp, fileName);
+    WSFrozenModel frozen;
+    frozen.load(fileName);
+    const PYLM & lm = wsMod->getLM();
+    int ret = 1, checked = 0;
+    for(int i = 0; i < (int)corp.size() && ret; i++) {
+        vector<int> chars;
+        for(int j = 0; j < (int)corp[i].length(); j++)
+            chars.push_back(frozen.getCharId(corp.getSymbol(corp[i][j])));
+        int node = wsMod->getInitNode(), fnode = frozen.getInitNode();
+        for(int beg = 0, end; beg <= (int)corp[i].length() && ret; beg = end+1) {
+            // each word, then the sentence end
+            end = (beg < (int)corp[i].length() ? labs[i].next(beg) : beg);
+            int len = end+1-beg;
+            if(beg == (int)corp[i].length()) len = 0;
+            int wid = wsMod->getVocab().getId(corp[i].substr(beg,len));
+            int fwid = (len ? frozen.getWordId(&chars[beg], len) : frozen.getInitId());
+            double prob = lm.getProb(node, wid, wsMod->getBase(wid));
+            double fprob = frozen.getProb(fnode, fwid, len);
+            // a word that was never seen gets only the base probability
+            double uprob = lm.getProb(node, 1000000, wsMod->getBase(corp[i].substr(0,1)));
+            double fuprob = frozen.getProb(fnode, -1, 1);
+            if(fwid < 0 || fabs(prob-fprob) > 1e-12 || fabs(uprob-fuprob) > 1e-12) {
+                cout << "Sentence "<<i<<" at "<<beg<<": frozen word "<<fwid<<" prob "<<fprob<<" != "<<prob<<" or unknown "<<fuprob<<" != "<<uprob<<endl;
+                ret = 0;
+            }
+            node = lm.getNext(node, wid);
+            fnode = frozen.getNext(fnode, fwid);
+            checked++;
+        }
+    }
+    if(frozen.getCharId("z") != -1 || frozen.getWordCount() == 0) {
+        cout << "Frozen model found an unknown character or has no words"<<endl;
+        ret = 0;
+    }
+    unlink(fileName.c_str());
+    delete wsMod;
+    cout << "WS frozen model matched "<<checked<<" word probabilities: "<<ret<<endl;
+    return ret;
+
+}
+
+int testWSSegment() {
+
+    // segment the sentences of a frozen model with the best path and with
+    //  samples. no sample may score above the best path, and the scores of
+    //  both must match a walk of the frozen LM along their boundaries. the
+    //  pool must give the same lines in the same order as one segmenter
+    WSConfig conf;
+    conf.setInt("iters",3);
+    conf.setInt("verbose",-1);
+    WordCorpus corp;
+    WSLabels labs;
+    WSModel * wsMod = makeRandomWSModel(29, 60, 20, 4, 4, 3, conf, corp, labs);
+    string fileName = makeTempFile("pgibbs-test-seg");
+    wsMod->freeze(corp, fileName);
+    delete wsMod;
+    WSFrozenModel frozen;
+    frozen.load(fileName);
+    unlink(fileName.c_str());
+    WSSegmenter best(frozen, false), samp(frozen, true);
+    // segment the lines of the corpus, then an unknown character and an
+    //  empty line
+    ostringstream text;
+    for(int i = 0; i < (int)corp.size(); i++)
+        for(int j = 0; j < (int)corp[i].length(); j++)
+            text << corp.getSymbol(corp[i][j]) << (j+1 < (int)corp[i].length() ? " " : "\n");
+    text << "a z b\n\n";
+    unsigned seed = 7;
+    int ret = 1;
+    istringstream lines(text.str());
+    string line, out;
+    vector<string> outs;
+    for(int i = 0; getline(lines, line) && ret; i++) {
+        istringstream iss(line);
+        vector<int> chars;
+        string tok;
+        while(iss >> tok) chars.push_back(frozen.getCharId(tok));
+        int len = chars.size();
+        Bounds bounds;
+        for(int j = 0; j < 11 && ret; j++) {
+            double score = (j == 0 ? best : samp).segment(len ? &chars[0] : 0, len, bounds, &seed);
+            double walk = 0;
+            int node = frozen.getInitNode();
+            for(int beg = 0, end; beg < len; beg = end+1) {
+                end = bounds.next(beg);
+                int wid = frozen.getWordId(&chars[beg], end+1-beg);
+                walk += log(frozen.getProb(node, wid, end+1-beg));
+                node = frozen.getNext(node, wid);
+            }
+            walk += log(frozen.getProb(node, frozen.getInitId(), 0));
+            double top = best.segment(len ? &chars[0] : 0, len, bounds, &seed);
+            if(fabs(score-walk) > 1e-9 || score > top+1e-9 || (len && !bounds[len-1])) {
+                cout << "Line "<<i<<" segmentation "<<j<<" scored "<<score<<", walk "<<walk<<", best "<<top<<endl;
+                ret = 0;
+            }
+        }
+        best.segmentLine(line, out, &seed);
+        outs.push_back(out);
+    }
+    istringstream poolIn(text.str());
+    ostringstream poolOut;
+    {
+        WSSegmentPool pool(frozen, false, 3, 4);
+        pool.segment(poolIn, poolOut, 2);
+        pool.finish(poolOut);
+        if(pool.getLineCount() != (long long)outs.size())
+            ret = 0;
+    }
+    istringstream poolLines(poolOut.str());
+    for(int i = 0; i < (int)outs.size() && ret; i++) {
+        if(!getline(poolLines, line) || line != outs[i]) {
+            cout << "Pool line "<<i<<" was '"<<line<<"', expected '"<<outs[i]<<"'"<<endl;
+            ret = 0;
+        }
+    }
+    cout << "WS segmenter matched "<<outs.size()<<" lines: "<<ret<<endl;
+    return ret;
+
+}
+
+int testWSSlice() {
+
+    // slice sampling only prunes the proposal, so with the acceptance step
+    //  the kept segmentations must follow the same distribution as when
+    //  sampling from the full lattice
+    int samps = 100000, ret = 1;
+    vector<double> full = sampleFrequencies(0, 0, 2, 5, samps);
+    double slices[2] = { 0.5, 1 };
+    for(int k = 0; k < 2; k++) {
+        vector<double> freqs = sampleFrequencies(slices[k], 0, 2, 5, samps);
+        double dist = 0;
+        for(int i = 0; i < (int)full.size(); i++)
+            dist += fabs(freqs[i]-full[i])/2;
+        cout << "WS slice "<<slices[k]<<" total variation from the full lattice: "<<dist<<endl;
+        if(dist > 0.04)
+            ret = 0;
+    }
+    return ret;
+
+}
+
+int testPYLMProbs() {
+
+    // the probability returned when adding should be the one before adding,
+    //  and the probability returned when removing the one after removing.
+    //  a word should be listed as emptied when its last customer leaves
+    srand(7);
+    PYLM lm;
+    lm.setN(3);
+    vector< pair<int,int> > added;
+    vector<int> emptied;
+    int ret = 1;
+    for(int iter = 0; iter < 5000 && ret; iter++) {
+        if(added.size() && rand() % 3 == 0) {
+            int pos = rand() % added.size();
+            int node = added[pos].first, wid = added[pos].second;
+            added.erase(added.begin()+pos);
+            double prob = lm.removeCust(node, wid, 0.01);
+            // the node is deleted if this was its last customer
+            bool alive = false, used = false;
+            for(int j = 0; j < (int)added.size(); j++) {
+                alive = alive || added[j].first == node;
+                used = used || added[j].second == wid;
+            }
+            if(alive && fabs(prob-lm.getProb(node, wid, 0.01)) > 1e-10) {
+                cout << "removeCust returned "<<prob<<" != "<<lm.getProb(node, wid, 0.01)<<endl;
+                ret = 0;
+            }
+            lm.takeEmptiedWords(emptied);
+            if(emptied.size() != (used ? 0 : 1) || (!used && emptied[0] != wid)) {
+                cout << "Removing the "<<(used?"":"last ")<<"customer of "<<wid<<" emptied "<<emptied.size()<<" words"<<endl;
+                ret = 0;
+            }
+        } else {
+            int node = 0, wid = rand() % 20;
+            for(int j = 0; j < 2; j++)
+                node = lm.getChild(node, rand() % 4, true, lm.getStrength(j), lm.getDisc(j));
+            double before = lm.getProb(node, wid, 0.01);
+            double prob = lm.addCust(node, wid, 0.01);
+            if(fabs(prob-before) > 1e-10) {
+                cout << "addCust returned "<<prob<<" != "<<before<<endl;
+                ret = 0;
+            }
+            added.push_back(pair<int,int>(node,wid));
+        }
+    }
+    cout << "PYLM add/remove probabilities and emptied words matched: "<<ret<<endl;
+    return ret;
+
+}
+
+int testPYLMCompact() {
+
+    // add customers in random 3-gram contexts and remove some of them, then
+    //  make sure that compaction keeps every probability and the reference,
+    //  and leaves the right nodes at each level
+    srand(11);
+    PYLM lm;
+    lm.setN(3);
+    vector< pair<int,int> > added, ctx;
+    for(int i = 0; i < 3000; i++) {
+        int c1 = rand() % 30, c2 = rand() % 30, wid = rand() % 50;
+        int node = lm.getChild(lm.getChild(0, c1, true, 1, 0), c2, true, 1, 0);
+        lm.addCust(node, wid, 0.01);
+        added.push_back(pair<int,int>(node, wid));
+        ctx.push_back(pair<int,int>(c1, c2));
+    }
+    for(int i = 0; i < 2000; i++)
+        lm.removeCust(added[i].first, added[i].second, 0.01);
+    vector<double> probs;
+    for(int i = 2000; i < 3000; i++)
+        probs.push_back(lm.getProb(added[i].first, added[i].second, 0.01));
+    int oldSize = lm.getArraySize(), ref = lm.getChild(0, 99, true, 1, 0);
+    vector<int> refs(1, ref);
+    lm.compact(refs);
+    int ret = (lm.getArraySize() < oldSize && lm.getChild(0, 99, false, 0, 0) == refs[0]);
+    for(int i = 2000; i < 3000; i++) {
+        int node = lm.getChild(lm.getChild(0, ctx[i].first, false, 0, 0), ctx[i].second, false, 0, 0);
+        if(fabs(lm.getProb(node, added[i].second, 0.01) - probs[i-2000]) > 1e-10)
+            ret = 0;
+    }
+    // the level index should only hold the contexts that are left
+    set<int> level1; set< pair<int,int> > level2;
+    level1.insert(99);
+    for(int i = 2000; i < 3000; i++) {
+        level1.insert(ctx[i].first);
+        level2.insert(ctx[i]);
+    }
+    if(lm.getLevelSize(0) != 1 || lm.getLevelSize(1) != (int)level1.size() || lm.getLevelSize(2) != (int)level2.size()) {
+        cout << "Level sizes "<<lm.getLevelSize(0)<<","<<lm.getLevelSize(1)<<","<<lm.getLevelSize(2)<<" != 1,"<<level1.size()<<","<<level2.size()<<endl;
+        ret = 0;
+    }
+    // sample the levels in parallel
+    lm.sampleParameters(1, 1, 1, 1, 4);
+    for(int i = 0; i < 3; i++) {
+        if(!(lm.getStrength(i) > 0) || !(lm.getDisc(i) > 0 && lm.getDisc(i) < 1)) {
+            cout << "Level "<<i<<" sampled bad parameters "<<lm.getStrength(i)<<", "<<lm.getDisc(i)<<endl;
+            ret = 0;
+        }
+    }
+    // threads are shared out by level size, without starting more than
+    //  asked for, the deepest level gets the most, and empty levels get none
+    int sizes[4] = { 1, 0, 30, 900 }, threads[4] = { 2, 3, 8, 40 };
+    for(int t = 0; t < 4; t++) {
+        vector< vector<int> > jobLevels;
+        vector<int> jobThreads, seen(4, 0);
+        PYLM::splitThreads(vector<int>(sizes, sizes+4), threads[t], jobLevels, jobThreads);
+        int used = 0, deep = 0, most = 0;
+        for(int j = 0; j < (int)jobLevels.size(); j++) {
+            used += jobThreads[j];
+            most = max(most, jobThreads[j]);
+            for(int k = 0; k < (int)jobLevels[j].size(); k++) {
+                seen[jobLevels[j][k]]++;
+                if(jobLevels[j][k] == 3) deep = jobThreads[j];
+            }
+        }
+        if(used != threads[t] || seen[0] != 1 || seen[1] != 0 || seen[2] != 1 || seen[3] != 1 || deep < most) {
+            cout << "Split of "<<threads[t]<<" threads used "<<used<<", deepest level got "<<deep<<endl;
+            ret = 0;
+        }
+    }
+    cout << "PYLM compaction from "<<oldSize<<" to "<<lm.getArraySize()<<" nodes kept probabilities: "<<ret<<endl;
+    return ret;
+
+}
+
+int testPYLMNext() {
+
+    // change a 3-gram LM at random, and check that transitions through the
+    //  cache always match the ones found by walking the tree
+    srand(13);
+    PYLM lm;
+    lm.setN(3);
+    PYLMNextCache cache;
+    vector< pair<int,int> > added;
+    int ret = 1;
+    for(int iter = 0; iter < 20000 && ret; iter++) {
+        int r = rand() % 10;
+        if(r < 3) {
+            int node = lm.getChild(lm.getChild(0, rand() % 30, true, 1, 0), rand() % 30, true, 1, 0);
+            int wid = rand() % 10;
+            lm.addCust(node, wid, 0.01);
+            added.push_back(pair<int,int>(node, wid));
+        } else if(r < 5 && added.size()) {
+            int pos = rand() % added.size();
+            lm.removeCust(added[pos].first, added[pos].second, 0.01);
+            added.erase(added.begin()+pos);
+        } else if(r == 5 && iter % 50 == 0) {
+            vector<int> refs;
+            for(int j = 0; j < (int)added.size(); j++)
+                refs.push_back(added[j].first);
+            lm.compact(refs);
+            for(int j = 0; j < (int)added.size(); j++)
+                added[j].first = refs[j];
+        } else if(added.size()) {
+            int node = added[rand() % added.size()].first, wid = rand() % 30;
+            int pick = rand() % 3;
+            if(pick == 1) node = lm.getNext(0, wid);
+            else if(pick == 2) node = 0;
+            int exp = lm.getNext(node, wid), act = lm.getNext(node, wid, cache);
+            if(exp != act) {
+                cout << "getNext("<<node<<","<<wid<<") from cache "<<act<<" != "<<exp<<endl;
+                ret = 0;
+            }
+        }
+    }
+    // remove most customers and compact, so old entries point past the end
+    while(added.size() > 20) {
+        lm.removeCust(added.back().first, added.back().second, 0.01);
+        added.pop_back();
+    }
+    vector<int> refs;
+    for(int j = 0; j < (int)added.size(); j++)
+        refs.push_back(added[j].first);
+    lm.compact(refs);
+    refs.push_back(0);
+    for(int j = 0; j < (int)refs.size(); j++)
+        for(int wid = 0; wid < 30; wid++)
+            if(lm.getNext(refs[j], wid) != lm.getNext(refs[j], wid, cache))
+                ret = 0;
+    pair<long long,long long> hits = cache.getHitCounts();
+    cout << "PYLM cached transitions matched: "<<ret<<" (hits "<<hits.first<<"/"<<hits.second<<")"<<endl;
+    return ret;
+
+}
+
+// one thread of the concurrent PYLM test, which adds customers to random
+//  3-gram contexts of its own and removes half of them again
+struct PYLMThreadJob {
+    PYLM* lm_;
+    unsigned seed_;
+    vector<int> counts_; // final customers of each (c1,c2,wid)
+    pthread_t thread_;
+};
+
+void* pylmThread(void* ptr) {
+    PYLMThreadJob & job = *(PYLMThreadJob*)ptr;
+    vector< vector<int> > added(2);
+    job.counts_ = vector<int>(10*10*10, 0);
+    for(int i = 0; i < 4000; i++) {
+        int c1 = rand_r(&job.seed_) % 10, c2 = rand_r(&job.seed_) % 10, wid = rand_r(&job.seed_) % 10;
+        int node = job.lm_->getChild(job.lm_->getChild(0, c1, true, 1, 0), c2, true, 1, 0);
+        job.lm_->addCust(node, wid, 0.01);
+        job.lm_->getProb(node, rand_r(&job.seed_) % 10, 0.01);
+        added[rand_r(&job.seed_) % 2].push_back((c1*10+c2)*10+wid);
+    }
+    for(int i = 0; i < (int)added[0].size(); i++) {
+        int key = added[0][i];
+        int node = job.lm_->getChild(job.lm_->getChild(0, key/100, false, 0, 0), key/10%10, false, 0, 0);
+        job.lm_->removeCust(node, key%10, 0.01);
+    }
+    for(int i = 0; i < (int)added[1].size(); i++)
+        job.counts_[added[1][i]]++;
+    return NULL;
+}
+
+int testPYLMConcurrent() {
+
+    // add and remove customers from several threads at once, then check
+    //  that the number of customers in each context is exactly right, and
+    //  that the nodes are indexed and deleted once concurrency ends
+    PYLM lm;
+    lm.setN(3);
+    lm.setConcurrent(true);
+    vector<PYLMThreadJob> jobs(4);
+    for(int i = 0; i < (int)jobs.size(); i++) {
+        jobs[i].lm_ = &lm;
+        jobs[i].seed_ = 17+i;
+        pthread_create(&jobs[i].thread_, NULL, pylmThread, (void*)&jobs[i]);
+    }
+    vector<int> counts(1000, 0);
+    for(int i = 0; i < (int)jobs.size(); i++) {
+        pthread_join(jobs[i].thread_, NULL);
+        for(int j = 0; j < 1000; j++)
+            counts[j] += jobs[i].counts_[j];
+    }
+    lm.setConcurrent(false);
+    int ret = 1;
+    for(int j = 0; j < 1000 && ret; j++) {
+        int node = lm.getChild(lm.getChild(0, j/100, false, 0, 0), j/10%10, false, 0, 0);
+        int found = (node == -1 ? 0 : lm.getCustCount(node, j%10));
+        if(found != counts[j]) {
+            cout << "context "<<j<<" has "<<found<<" customers, expected "<<counts[j]<<endl;
+            ret = 0;
+        }
+    }
+    // the nodes made by the threads were added to the index of their level
+    int reached[3] = { 1, 0, 0 };
+    const gng::SmallVector<PYLMChild,2> & firsts = lm.getChildren(0);
+    for(int i = 0; i < (int)firsts.size(); i++) {
+        reached[1]++;
+        reached[2] += lm.getChildren(firsts[i].node_).size();
+    }
+    for(int l = 0; l < 3; l++) {
+        if(lm.getLevelSize(l) != reached[l]) {
+            cout << "level "<<l<<" has "<<lm.getLevelSize(l)<<" nodes, but "<<reached[l]<<" can be reached"<<endl;
+            ret = 0;
+        }
+    }
+    // removing the rest concurrently deletes the empty contexts afterwards
+    lm.setConcurrent(true);
+    for(int j = 0; j < 1000; j++) {
+        int node = lm.getChild(lm.getChild(0, j/100, false, 0, 0), j/10%10, false, 0, 0);
+        for(int k = 0; k < counts[j]; k++)
+            lm.removeCust(node, j%10, 0.01);
+    }
+    lm.setConcurrent(false);
+    if(!lm.isEmpty() || lm.getLevelSize(2) != 0) {
+        cout << "after removing every customer, "<<lm.getLevelSize(2)<<" contexts are left"<<endl;
+        ret = 0;
+    }
+    cout << "Concurrent PYLM kept customer counts: "<<ret<<endl;
+    return ret;
+
+}
+
 int main(int argc, char **argv) {
     cout << "Hello world" << endl;
 
     int correct = 0, total = 0;
 
     correct += testHMMSample(); total++;
+    correct += testHMMAsync(); total++;
     correct += testWSSample(); total++;
+    correct += testAdaptiveIndex(); total++;
+    correct += testHistTableSet(); total++;
+    correct += testSampleParameters(); total++;
+    correct += testWSVocab(); total++;
+    correct += testWSConstraints(); total++;
+    correct += testWSPointwise(); total++;
+    correct += testWSChunk(); total++;
+    correct += testWSBounds(); total++;
+    correct += testWSFrozen(); total++;
+    correct += testWSSegment(); total++;
+    correct += testWSSlice(); total++;
+    correct += testPYLMProbs(); total++;
+    correct += testPYLMCompact(); total++;
+    correct += testPYLMNext(); total++;
+    correct += testPYLMConcurrent(); total++;
 
     cout << correct << "/" << total << " correct"<<endl;
 